@@ -11,11 +11,15 @@ int f() {
   block_device_t *hd = get_block_device(makedev(DEV_MAJ_HDA, 0));
   assert(hd);
 
-  /* Get some buffer space. */
-  uintptr_t buf = vmspace_alloc(&kernel_vmspace, 0x1000, 1);
+  /* Get some physically contiguous buffer space, so the whole read can be
+     described by a single DMA descriptor. */
+  uint64_t phys = alloc_pages_contig(2, PAGE_REQ_UNDER4GB);
+  assert(phys != ~0ULL);
+  uintptr_t buf = vmspace_alloc(&kernel_vmspace, 0x4000, 0);
+  map(buf, phys, 4, PAGE_WRITE);
 
   assert(hd->read);
-  int ret = hd->read(hd, 0, (void*)buf, 0x1000);
+  int ret = hd->read(hd, 0, (void*)buf, 0x4000);
 
   kprintf("Ret: %d\n", ret);
 
@@ -0,0 +1,80 @@
+/* Measures the effect of slab colouring on a pointer-chasing workload.
+
+   A linked list is threaded through the first object of each of a number
+   of slabs, and walked repeatedly. Without colouring every first object
+   starts at offset 0 of an 8KB slab, so they all compete for the same few
+   cache sets; with colouring they are spread over as many cache lines as
+   the slack at the end of each slab allows. */
+
+#include "hal.h"
+#include "slab.h"
+#include "stdio.h"
+#include "vmspace.h"
+
+/* From the host C library. */
+long clock(void);
+#define CLOCKS_PER_SEC 1000000
+
+#define OBJ_SZ      1024
+#define NUM_SLABS   64
+#define NUM_STEPS   20000000
+
+typedef struct node {
+  struct node *next;
+} node_t;
+
+static void *objs[NUM_SLABS * (SLAB_SIZE / OBJ_SZ)];
+
+/* Build the list through the first object of NUM_SLABS slabs from a fresh
+   cache, and return the time taken per step to walk it. If 'color' is
+   zero, colouring is switched off. */
+static unsigned bench(vmspace_t *vms, int color) {
+  static slab_cache_t c;
+  slab_cache_create(&c, vms, OBJ_SZ, NULL, NULL);
+  if (!color)
+    c.ncolors = 1;
+
+  slab_cache_stats_t st;
+  slab_cache_get_stats(&c, &st);
+  unsigned n = NUM_SLABS * st.objs_per_slab;
+  for (unsigned i = 0; i < n; ++i)
+    objs[i] = slab_cache_alloc(&c);
+
+  node_t *head = objs[0];
+  for (unsigned i = 1; i < NUM_SLABS; ++i)
+    ((node_t*)objs[(i-1) * st.objs_per_slab])->next =
+      objs[i * st.objs_per_slab];
+  ((node_t*)objs[(NUM_SLABS-1) * st.objs_per_slab])->next = head;
+
+  volatile node_t *p = head;
+  long t = clock();
+  for (unsigned i = 0; i < NUM_STEPS; ++i)
+    p = p->next;
+  t = clock() - t;
+
+  for (unsigned i = 0; i < n; ++i)
+    slab_cache_free(&c, objs[i]);
+  slab_cache_destroy(&c);
+
+  return (unsigned)(((uint64_t)t * (1000000000 / CLOCKS_PER_SEC) * 1000) /
+                    NUM_STEPS);
+}
+
+int f() {
+  static vmspace_t vms;
+  vmspace_init(&vms, 0x10000000, 0x10000000);
+
+  unsigned plain = bench(&vms, 0);
+  unsigned colored = bench(&vms, 1);
+  kprintf("%u slabs of %u byte objects: uncoloured %u.%03uns per step, "
+          "coloured %u.%03uns per step\n", NUM_SLABS, OBJ_SZ,
+          plain / 1000, plain % 1000, colored / 1000, colored % 1000);
+  return 0;
+}
+
+static const char *p[] = {"console", "hosted/free_memory", NULL};
+static init_fini_fn_t x run_on_startup = {
+  .name = "slab-color-bench",
+  .prerequisites = p,
+  .fn = &f
+};
@@ -0,0 +1,172 @@
+/* Measures the cost of vmspace_alloc and vmspace_free as the number of live
+   allocations grows.
+
+   For each heap size, a steady state is reached by allocating that many
+   blocks and then repeatedly freeing a random one and allocating another.
+   With free lists, the time per alloc/free pair should not grow with the
+   number of live allocations.
+
+   The same sequence is then run against a frozen copy of the allocator
+   used before free lists were introduced, which kept one bitmap of free
+   blocks per order and searched them with xbitmap_first_set() on every
+   allocation. */
+
+#include "adt/xbitmap.h"
+#include "hal.h"
+#include "kmalloc.h"
+#include "math.h"
+#include "stdio.h"
+#include "vmspace.h"
+
+/* From the host C library. */
+long clock(void);
+#define CLOCKS_PER_SEC 1000000
+
+/* 1M live 4KB blocks would need 4GB of address space, more than a 32-bit
+   vmspace can hold, so the largest run uses as many as fit. */
+#define MAX_LIVE    180000
+#define NUM_OPS     20000
+
+static uintptr_t live[MAX_LIVE];
+
+static unsigned rand_state;
+static unsigned next_rand() {
+  rand_state = rand_state * 1103515245 + 12345;
+  return rand_state >> 8;
+}
+
+/* The previous allocator. It only hands out address space. */
+typedef struct old_vmspace {
+  uintptr_t start;
+  xbitmap_t orders[VMSPACE_NUM_ORDERS];
+} old_vmspace_t;
+
+static void *old_bitmap_alloc(unsigned sz, void *p) {
+  return kmalloc(sz);
+}
+static void old_bitmap_free(void *ptr, void *p) {
+  kfree(ptr);
+}
+
+static void old_init(old_vmspace_t *vms, uintptr_t addr, uintptr_t sz) {
+  vms->start = addr;
+  for (unsigned i = 0; i < VMSPACE_NUM_ORDERS; ++i)
+    xbitmap_init(&vms->orders[i], get_page_size(), &old_bitmap_alloc,
+                 &old_bitmap_free, NULL);
+
+  unsigned i = MAX_BUDDY_SZ_LOG2;
+  uintptr_t idx = 0;
+  while (sz > 0 && i >= MIN_BUDDY_SZ_LOG2) {
+    if (sz >= (1U << i)) {
+      xbitmap_set(&vms->orders[i-MIN_BUDDY_SZ_LOG2], idx++);
+      sz -= 1U << i;
+    } else {
+      --i;
+      idx <<= 1;
+    }
+  }
+}
+
+static uintptr_t old_alloc(old_vmspace_t *vms, unsigned sz) {
+  unsigned log_sz = log2_roundup(sz);
+  unsigned orig_log_sz = log_sz;
+
+  /* Search for a free block, going up the orders until one is found. */
+  int idx = -1;
+  for (; log_sz <= MAX_BUDDY_SZ_LOG2; ++log_sz) {
+    idx = xbitmap_first_set(&vms->orders[log_sz - MIN_BUDDY_SZ_LOG2]);
+    if (idx != -1)
+      break;
+  }
+  if (idx == -1)
+    return 0;
+
+  /* Split it back down to the requested size. */
+  for (; log_sz != orig_log_sz; --log_sz) {
+    unsigned o = log_sz - MIN_BUDDY_SZ_LOG2;
+    xbitmap_clear(&vms->orders[o], idx);
+    idx <<= 1;
+    xbitmap_set(&vms->orders[o-1], idx);
+    xbitmap_set(&vms->orders[o-1], idx+1);
+  }
+
+  xbitmap_clear(&vms->orders[log_sz - MIN_BUDDY_SZ_LOG2], idx);
+  return vms->start + ((uintptr_t)idx << log_sz);
+}
+
+static void old_free(old_vmspace_t *vms, unsigned sz, uintptr_t addr) {
+  unsigned log_sz = log2_roundup(sz);
+  unsigned idx = (addr - vms->start) >> log_sz;
+
+  /* Merge with the buddy for as long as it is free too. */
+  for (; log_sz <= MAX_BUDDY_SZ_LOG2; ++log_sz, idx >>= 1) {
+    unsigned o = log_sz - MIN_BUDDY_SZ_LOG2;
+    xbitmap_set(&vms->orders[o], idx);
+    if (log_sz == MAX_BUDDY_SZ_LOG2 || xbitmap_isclear(&vms->orders[o], idx^1))
+      break;
+    xbitmap_clear(&vms->orders[o], idx);
+    xbitmap_clear(&vms->orders[o], idx^1);
+  }
+}
+
+/* Return the number of nanoseconds per operation, given a clock() delta. */
+static unsigned ns_per_op(long ticks, unsigned ops) {
+  return (unsigned)(((uint64_t)ticks * (1000000000 / CLOCKS_PER_SEC)) / ops);
+}
+
+/* Run the benchmark with 'n' live allocations, in a fresh vmspace at
+   'start'. Each run needs its own address range, as the vmspace's own
+   metadata stays mapped afterwards. */
+static void bench(unsigned n, uintptr_t start, uintptr_t size) {
+  static vmspace_t vms;
+  vmspace_init(&vms, start, size);
+
+  rand_state = 1;
+  for (unsigned i = 0; i < n; ++i)
+    live[i] = vmspace_alloc(&vms, 0x1000, 0);
+
+  long t = clock();
+  for (unsigned i = 0; i < NUM_OPS; ++i) {
+    unsigned j = next_rand() % n;
+    vmspace_free(&vms, 0x1000, live[j], 0);
+    live[j] = vmspace_alloc(&vms, 0x1000, 0);
+  }
+  long freelist = clock() - t;
+
+  for (unsigned i = 0; i < n; ++i)
+    vmspace_free(&vms, 0x1000, live[i], 0);
+
+  /* The same again with the old allocator. Its bitmaps live on the heap, so
+     it can reuse the range; xbitmaps cannot be freed, so they leak. */
+  static old_vmspace_t ovms;
+  old_init(&ovms, start, size);
+
+  rand_state = 1;
+  for (unsigned i = 0; i < n; ++i)
+    live[i] = old_alloc(&ovms, 0x1000);
+
+  t = clock();
+  for (unsigned i = 0; i < NUM_OPS; ++i) {
+    unsigned j = next_rand() % n;
+    old_free(&ovms, 0x1000, live[j]);
+    live[j] = old_alloc(&ovms, 0x1000);
+  }
+  long bitmap = clock() - t;
+
+  kprintf("%u live: free lists %uns, bitmap search %uns per alloc+free\n",
+          n, ns_per_op(freelist, NUM_OPS), ns_per_op(bitmap, NUM_OPS));
+}
+
+int f() {
+  bench(10000, 0x10000000, 0x04000000);
+  bench(100000, 0x20000000, 0x20000000);
+  bench(MAX_LIVE, 0x40000000, 0x30000000);
+  return 0;
+}
+
+static const char *p[] = {"console", "hosted/free_memory", "kmalloc", NULL};
+static init_fini_fn_t x run_on_startup = {
+  .name = "vmspace-bench",
+  .prerequisites = p,
+  .fn = &f
+};
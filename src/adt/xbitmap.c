@@ -3,63 +3,122 @@
 #include "string.h"
 #include "assert.h"
 
-/* Given a pointer to a block, return the address of the next block as a
-   uint8_t** */
-#define NEXT_BLK(x) (uint8_t**)((uintptr_t)x + xb->blocksz - sizeof(void*))
+/* Bits are stored in 32-bit words, bit 'idx' being bit idx%32 of word
+   idx/32. Each block holds data_words() words of bits, followed by the
+   summary for that block if the summary is enabled.
 
-/* Create a new block and return a pointer to it. */
+   The summary has two levels: bit 'w' of the level 1 summary is set if data
+   word 'w' is nonzero, and bit 'i' of the single level 2 word is set if
+   level 1 word 'i' is nonzero. Finding the next nonzero data word in a
+   block then reads at most two level 1 words and the level 2 word. */
+
+/* Return the number of data words in each block. */
+static unsigned data_words(xbitmap_t *xb) {
+  unsigned w = xb->blocksz / sizeof(uint32_t);
+  if (!xb->summary)
+    return w;
+
+  /* Leave room for one level 1 bit per data word, and the level 2 word.
+     The level 2 word can only describe 32 level 1 words. */
+  unsigned d = ((w - 1) * 32) / 33;
+  if (d > 32*32)
+    d = 32*32;
+  return d;
+}
+
+/* Return the level 1 summary of 'block'. The level 2 word follows it. */
+static uint32_t *summary(xbitmap_t *xb, uint32_t *block) {
+  return &block[data_words(xb)];
+}
+
+static uint32_t *summary_l2(xbitmap_t *xb, uint32_t *block) {
+  unsigned d = data_words(xb);
+  return &block[d + (d + 31) / 32];
+}
+
+/* Create a new block and return a pointer to it, or NULL if the allocator
+   failed. */
 static uint8_t *newblock(xbitmap_t *xb) {
   uint8_t *x = (uint8_t*)xb->alloc(xb->blocksz, xb->alloc_p);
-  memset(x, 0, xb->blocksz);
+  if (x && !xb->alloc_zeroed)
+    memset(x, 0, xb->blocksz);
   return x;
 }
 
-/* Return a pointer to the n'th byte in the bitmap. If the bitmap is smaller
-   than 'byte' bytes, and extend is nonzero, extend the bitmap. Else return
-   NULL. */
-static uint8_t *findbyte(xbitmap_t *xb, unsigned byte, int extend) {
-  uint8_t *block = xb->firstblock;
+/* Return the number of block pointers held by an indirect block. */
+static unsigned ptrs_per_block(xbitmap_t *xb) {
+  return xb->blocksz / sizeof(void*);
+}
+
+/* Return the block (or indirect block) that 'slot' points to. If there is
+   none, create one if 'extend' is nonzero, else return NULL. Also returns
+   NULL if a new block could not be allocated. If 'extend' is
+   XBITMAP_ATOMIC the new block is installed with a CAS, and given back to
+   the allocator if another thread got there first. */
+#define XBITMAP_ATOMIC 2
+static void *get_block(xbitmap_t *xb, void **slot, int extend) {
+  void *blk = *(void *volatile*)slot;
+  if (blk || !extend)
+    return blk;
 
-  /* Early-exit if no memory has yet been allocated. */
-  if (!block) {
-    if (!extend) return NULL;
-    xb->firstblock = block = newblock(xb);
+  blk = newblock(xb);
+  if (!blk)
+    return NULL;
+  if (extend != XBITMAP_ATOMIC) {
+    *slot = blk;
+    return blk;
   }
 
-  while (block) {
-    /* Number of bytes in this block */
-    unsigned nb = xb->blocksz-sizeof(void*);
-    
-    /* If the byte index is past the end of this block */
-    if (byte >= nb) {
-      byte -= nb;
-      uint8_t **blockaddr = NEXT_BLK(block);
-      block = *blockaddr;
-
-      /* We reached the last block - allocate a new one. */
-      if (!block) {
-        if (!extend) return NULL;
-        block = newblock(xb);
-        *blockaddr = block;
-      }
-      
-    } else {
-      /* Byte index is within this block. */
-      return &block[byte];
-    }
+  if (!__sync_bool_compare_and_swap(slot, NULL, blk)) {
+    xb->free(blk, xb->alloc_p);
+    blk = *(void *volatile*)slot;
   }
-  assert(0 && "algorithmic error!");
+  return blk;
 }
 
-/* Returns the index of the least significant bit that is set in byte.
-   If byte == 0, the behaviour is undefined. */
-static int lsb_set(uint8_t byte) {
-  int i = 0;
-  while ((byte & 1) == 0) {
-    ++i;
-    byte >>= 1;
+/* Return the slot in the radix tree that points to block 'b'. If the
+   indirect blocks leading to it do not exist, create them if 'extend' is
+   nonzero, else return NULL. */
+static uint8_t **block_slot(xbitmap_t *xb, unsigned b, int extend) {
+  if (b < XBITMAP_NDIRECT)
+    return &xb->direct[b];
+  b -= XBITMAP_NDIRECT;
+
+  unsigned n = ptrs_per_block(xb);
+  if (b < n) {
+    uint8_t **indirect = get_block(xb, (void**)&xb->indirect, extend);
+    return indirect ? &indirect[b] : NULL;
   }
-  return i;
+  b -= n;
+
+  assert(b < n*n && "xbitmap index out of range!");
+  uint8_t ***dindirect = get_block(xb, (void**)&xb->dindirect, extend);
+  if (!dindirect)
+    return NULL;
+  uint8_t **indirect = get_block(xb, (void**)&dindirect[b/n], extend);
+  return indirect ? &indirect[b%n] : NULL;
+}
+
+/* Return block 'b', or NULL if it does not exist and 'extend' is zero. */
+static uint32_t *findblock(xbitmap_t *xb, unsigned b, int extend) {
+  uint8_t **slot = block_slot(xb, b, extend);
+  if (!slot)
+    return NULL;
+  return get_block(xb, (void**)slot, extend);
+}
+
+/* Return a pointer to the n'th word in the bitmap, and in 'blk' the block
+   containing it. If the block does not exist yet and extend is nonzero,
+   create it. Else return NULL. */
+static uint32_t *findword(xbitmap_t *xb, unsigned word, int extend,
+                          uint32_t **blk) {
+  unsigned nw = data_words(xb);
+  uint32_t *block = findblock(xb, word / nw, extend);
+  if (!block)
+    return NULL;
+
+  *blk = block;
+  return &block[word % nw];
 }
 
 void xbitmap_init(xbitmap_t *xb, int blocksz, alloc_fn_t alloc, free_fn_t free, void *alloc_p) {
@@ -67,48 +126,321 @@ void xbitmap_init(xbitmap_t *xb, int blocksz, alloc_fn_t alloc, free_fn_t free,
   xb->alloc = alloc;
   xb->free = free;
   xb->alloc_p = alloc_p;
-  xb->firstblock = NULL;
+  xb->alloc_zeroed = 0;
+  xb->summary = 0;
+  for (unsigned i = 0; i < XBITMAP_NDIRECT; ++i)
+    xb->direct[i] = NULL;
+  xb->indirect = NULL;
+  xb->dindirect = NULL;
   xb->extent = 0;
 }
 
-void xbitmap_set(xbitmap_t *xb, unsigned idx) {
-  uint8_t *byte = findbyte(xb, idx/8, 1);
-  *byte |= (1 << (idx%8));
+/* Set the bits in 'mask' in word 'w', creating its block if needed.
+   Returns -1 if the block could not be allocated. */
+static int word_set(xbitmap_t *xb, unsigned w, uint32_t mask) {
+  uint32_t *block;
+  uint32_t *word = findword(xb, w, 1, &block);
+  if (!word)
+    return -1;
+  *word |= mask;
+
+  if (xb->summary) {
+    unsigned i = word - block;
+    summary(xb, block)[i/32] |= 1U << (i%32);
+    *summary_l2(xb, block) |= 1U << (i/32);
+  }
+  return 0;
+}
+
+/* Clear the bits in 'mask' in word 'w'. Missing blocks are already clear,
+   so are left alone. */
+static void word_clear(xbitmap_t *xb, unsigned w, uint32_t mask) {
+  uint32_t *block;
+  uint32_t *word = findword(xb, w, 0, &block);
+  if (!word)
+    return;
+  *word &= ~mask;
+
+  if (xb->summary && *word == 0) {
+    unsigned i = word - block;
+    uint32_t *l1 = &summary(xb, block)[i/32];
+    *l1 &= ~(1U << (i%32));
+    if (*l1 == 0)
+      *summary_l2(xb, block) &= ~(1U << (i/32));
+  }
+}
+
+/* Return the mask of bits 'lo' to 'hi' inclusive, 0 <= lo <= hi < 32. */
+static uint32_t bit_mask(unsigned lo, unsigned hi) {
+  uint32_t top = (hi == 31) ? ~0U : (1U << (hi+1)) - 1;
+  return top & ~((1U << lo) - 1);
+}
+
+/* Return the number of blocks that can hold bits up to the extent. */
+static unsigned num_blocks(xbitmap_t *xb) {
+  return xb->extent / (data_words(xb) * 32) + 1;
+}
+
+/* Return the index of the first nonzero word in 'block' at or after word
+   'w', or -1 if there is none. */
+static int next_nonzero_word(xbitmap_t *xb, uint32_t *block, unsigned w) {
+  unsigned nw = data_words(xb);
+  if (!xb->summary) {
+    for (; w < nw; ++w)
+      if (block[w] != 0)
+        return w;
+    return -1;
+  }
+
+  if (w >= nw)
+    return -1;
+
+  /* Look in the rest of the level 1 word covering 'w', then use the level
+     2 word to jump straight to the next nonzero level 1 word. */
+  uint32_t *l1 = summary(xb, block);
+  unsigned i = w/32;
+  uint32_t x = l1[i] & ~((1U << (w%32)) - 1);
+  if (x)
+    return i*32 + __builtin_ctz(x);
+
+  uint32_t l2 = (i == 31) ? 0 : *summary_l2(xb, block) & ~((2U << i) - 1);
+  if (!l2)
+    return -1;
+  i = __builtin_ctz(l2);
+  return i*32 + __builtin_ctz(l1[i]);
+}
 
+int xbitmap_set(xbitmap_t *xb, unsigned idx) {
+  if (word_set(xb, idx/32, 1U << (idx%32)) == -1)
+    return -1;
   if (idx > xb->extent) xb->extent = idx;
+  return 0;
 }
 
 void xbitmap_clear(xbitmap_t *xb, unsigned idx) {
-  uint8_t *byte = findbyte(xb, idx/8, 1);
-  *byte &= ~(1 << (idx%8));
-
+  word_clear(xb, idx/32, 1U << (idx%32));
   if (idx > xb->extent) xb->extent = idx;
 }
 
+int xbitmap_set_range(xbitmap_t *xb, unsigned idx, unsigned len) {
+  if (len == 0)
+    return 0;
+
+  unsigned last = idx + len - 1;
+  for (unsigned w = idx/32; w <= last/32; ++w) {
+    unsigned lo = (w == idx/32) ? idx%32 : 0;
+    unsigned hi = (w == last/32) ? last%32 : 31;
+    if (word_set(xb, w, bit_mask(lo, hi)) == -1)
+      return -1;
+  }
+  if (last > xb->extent) xb->extent = last;
+  return 0;
+}
+
+void xbitmap_clear_range(xbitmap_t *xb, unsigned idx, unsigned len) {
+  if (len == 0)
+    return;
+
+  unsigned last = idx + len - 1;
+  for (unsigned w = idx/32; w <= last/32; ++w) {
+    unsigned lo = (w == idx/32) ? idx%32 : 0;
+    unsigned hi = (w == last/32) ? last%32 : 31;
+    word_clear(xb, w, bit_mask(lo, hi));
+  }
+  if (last > xb->extent) xb->extent = last;
+}
+
 int xbitmap_isset(xbitmap_t *xb, unsigned idx) {
-  uint8_t *byte = findbyte(xb, idx/8, 0);
-  return byte && *byte & (1 << (idx%8));
+  uint32_t *block;
+  uint32_t *word = findword(xb, idx/32, 0, &block);
+  return word && (*word & (1U << (idx%32)));
 }
 int xbitmap_isclear(xbitmap_t *xb, unsigned idx) {
   return !xbitmap_isset(xb, idx);
 }
 
+int xbitmap_find_next_set(xbitmap_t *xb, unsigned idx) {
+  if (idx > xb->extent)
+    return -1;
+
+  unsigned nw = data_words(xb);
+  unsigned b = idx / (nw*32);
+  unsigned w = (idx / 32) % nw;
+  /* Bits below 'idx' in its own word are ignored. */
+  uint32_t ignore = (1U << (idx%32)) - 1;
+
+  for (; b < num_blocks(xb); ++b, w = 0, ignore = 0) {
+    uint32_t *words = findblock(xb, b, 0);
+    /* Blocks that were never touched are all clear. */
+    if (!words)
+      continue;
+
+    if (words[w] & ~ignore) {
+      unsigned i = (b*nw + w) * 32 + __builtin_ctz(words[w] & ~ignore);
+      return (i > xb->extent) ? -1 : (int)i;
+    }
+
+    int w2 = (w+1 < nw) ? next_nonzero_word(xb, words, w+1) : -1;
+    if (w2 != -1) {
+      unsigned i = (b*nw + w2) * 32 + __builtin_ctz(words[w2]);
+      return (i > xb->extent) ? -1 : (int)i;
+    }
+  }
+  return -1;
+}
+
 int xbitmap_first_set(xbitmap_t *xb) {
-  uint8_t *block = xb->firstblock;
-
-  /* The number of bytes available per block for storage. */
-  unsigned nb = xb->blocksz - sizeof(void*);
-  
-  unsigned i = 0;
-  while (block && i < xb->extent/8) {
-    for(unsigned thisblock_i = 0; thisblock_i < nb; ++thisblock_i) {
-      if (block[thisblock_i] != 0) {
-        int idx = (i+thisblock_i) * 8 + lsb_set(block[thisblock_i]);
-        return (idx > (int)xb->extent) ? -1 : idx;
+  return xbitmap_find_next_set(xb, 0);
+}
+
+int xbitmap_find_first_clear(xbitmap_t *xb) {
+  unsigned nw = data_words(xb);
+
+  for (unsigned b = 0; b < num_blocks(xb); ++b) {
+    uint32_t *words = findblock(xb, b, 0);
+    if (!words)
+      return b*nw*32;
+
+    for (unsigned w = 0; w < nw; ++w)
+      if (words[w] != ~0U)
+        return (b*nw + w) * 32 + __builtin_ctz(~words[w]);
+  }
+  /* Everything past the extent is clear. */
+  return num_blocks(xb) * nw * 32;
+}
+
+int xbitmap_find_run(xbitmap_t *xb, unsigned len) {
+  unsigned nw = data_words(xb);
+
+  /* The current run of clear bits is 'run' long and starts at 'start'. */
+  unsigned run = 0, start = 0;
+  for (unsigned b = 0; b < num_blocks(xb); ++b) {
+    uint32_t *words = findblock(xb, b, 0);
+
+    for (unsigned w = 0; w < nw; ++w) {
+      unsigned base = (b*nw + w) * 32;
+      uint32_t x = words ? words[w] : 0;
+
+      /* Fast paths for a word that is entirely clear or entirely set. */
+      if (x == 0) {
+        if (run == 0) start = base;
+        run += 32;
+        if (run >= len) return start;
+        continue;
+      }
+      if (x == ~0U) {
+        run = 0;
+        continue;
+      }
+
+      unsigned bit = 0;
+      while (bit < 32) {
+        uint32_t rest = x >> bit;
+        /* Number of clear bits before the next set bit, or to the end of
+           the word. */
+        unsigned zeroes = rest ? (unsigned)__builtin_ctz(rest) : 32 - bit;
+        if (zeroes) {
+          if (run == 0) start = base + bit;
+          run += zeroes;
+          if (run >= len) return start;
+        }
+        bit += zeroes;
+        if (bit >= 32)
+          break;
+
+        /* Skip the set bits; the run starts again after them. */
+        run = 0;
+        bit += __builtin_ctz(~(x >> bit));
+      }
+    }
+  }
+
+  /* Everything past the extent is clear. */
+  if (run == 0) start = num_blocks(xb) * nw * 32;
+  return start;
+}
+
+unsigned xbitmap_popcount(xbitmap_t *xb) {
+  unsigned nw = data_words(xb);
+
+  unsigned n = 0;
+  for (unsigned b = 0; b < num_blocks(xb); ++b) {
+    uint32_t *words = findblock(xb, b, 0);
+    if (!words)
+      continue;
+
+    for (int w = next_nonzero_word(xb, words, 0); w != -1;
+         w = (w+1 < (int)nw) ? next_nonzero_word(xb, words, w+1) : -1)
+      n += __builtin_popcount(words[w]);
+  }
+  return n;
+}
+
+/* Raise the extent to 'idx', racing with other atomic operations. */
+static void atomic_extend(xbitmap_t *xb, unsigned idx) {
+  unsigned e;
+  while ((e = *(volatile unsigned*)&xb->extent) < idx &&
+         !__sync_bool_compare_and_swap(&xb->extent, e, idx))
+    ;
+}
+
+/* Return a pointer to the word holding bit 'idx', creating its block if
+   'extend' is nonzero, else NULL if it has no block. */
+static volatile uint32_t *atomic_findword(xbitmap_t *xb, unsigned idx,
+                                          int extend) {
+  assert(!xb->summary && "The summary can't be kept up to date atomically!");
+
+  unsigned nw = data_words(xb);
+  uint32_t *block = findblock(xb, idx / 32 / nw, extend ? XBITMAP_ATOMIC : 0);
+  return block ? &block[(idx / 32) % nw] : NULL;
+}
+
+void xbitmap_atomic_set(xbitmap_t *xb, unsigned idx) {
+  volatile uint32_t *word = atomic_findword(xb, idx, 1);
+  /* Raise the extent first, so readers never see a bit beyond it. */
+  atomic_extend(xb, idx);
+  __sync_fetch_and_or(word, 1U << (idx%32));
+}
+
+void xbitmap_atomic_clear(xbitmap_t *xb, unsigned idx) {
+  volatile uint32_t *word = atomic_findword(xb, idx, 0);
+  if (word)
+    __sync_fetch_and_and(word, ~(1U << (idx%32)));
+}
+
+int xbitmap_atomic_test_and_set(xbitmap_t *xb, unsigned idx) {
+  volatile uint32_t *word = atomic_findword(xb, idx, 1);
+  atomic_extend(xb, idx);
+  uint32_t mask = 1U << (idx%32);
+  return (__sync_fetch_and_or(word, mask) & mask) != 0;
+}
+
+int xbitmap_atomic_isset(xbitmap_t *xb, unsigned idx) {
+  volatile uint32_t *word = atomic_findword(xb, idx, 0);
+  return word && (*word & (1U << (idx%32)));
+}
+
+int xbitmap_atomic_claim_first_clear(xbitmap_t *xb, unsigned limit) {
+  assert(!xb->summary && "The summary can't be kept up to date atomically!");
+  unsigned nw = data_words(xb);
+
+  for (unsigned b = 0; b*nw*32 < limit; ++b) {
+    uint32_t *words = findblock(xb, b, XBITMAP_ATOMIC);
+
+    for (unsigned w = 0; w < nw && (b*nw + w)*32 < limit; ++w) {
+      volatile uint32_t *word = &words[w];
+      uint32_t x;
+      while ((x = *word) != ~0U) {
+        unsigned idx = (b*nw + w) * 32 + __builtin_ctz(~x);
+        if (idx >= limit)
+          return -1;
+
+        atomic_extend(xb, idx);
+        if (__sync_bool_compare_and_swap(word, x, x | (1U << (idx%32))))
+          return idx;
+        /* Someone else changed the word; look at it again. */
       }
     }
-    i += nb;
-    block = * NEXT_BLK(block);
   }
   return -1;
 }
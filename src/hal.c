@@ -161,6 +161,50 @@ int free_page(uint64_t page) weak;
 int free_page(uint64_t page) {
   return -1;
 }
+int alloc_pages(unsigned n, int req, uint64_t *pages) weak;
+int alloc_pages(unsigned n, int req, uint64_t *pages) {
+  return -1;
+}
+int free_pages(unsigned n, uint64_t *pages) weak;
+int free_pages(unsigned n, uint64_t *pages) {
+  return -1;
+}
+int pmm_add_range(uint64_t base, uint64_t len) weak;
+int pmm_add_range(uint64_t base, uint64_t len) {
+  return -1;
+}
+uint64_t alloc_pages_contig(unsigned order, int req) weak;
+uint64_t alloc_pages_contig(unsigned order, int req) {
+  return ~0ULL;
+}
+int free_pages_contig(uint64_t base, unsigned order) weak;
+int free_pages_contig(uint64_t base, unsigned order) {
+  return -1;
+}
+int register_shrinker(shrinker_fn_t fn) weak;
+int register_shrinker(shrinker_fn_t fn) {
+  return -1;
+}
+int pmm_get_stats(pmm_stats_t *s) weak;
+int pmm_get_stats(pmm_stats_t *s) {
+  return -1;
+}
+page_t *get_page(uint64_t p) weak;
+page_t *get_page(uint64_t p) {
+  return NULL;
+}
+int page_ref(uint64_t p) weak;
+int page_ref(uint64_t p) {
+  return -1;
+}
+int page_unref(uint64_t p) weak;
+int page_unref(uint64_t p) {
+  return -1;
+}
+int page_sole_owner(uint64_t p) weak;
+int page_sole_owner(uint64_t p) {
+  return 0;
+}
 int clone_address_space(address_space_t *dest, int make_cow) weak;
 int clone_address_space(address_space_t *dest, int make_cow) {
   return -1;
@@ -193,6 +237,18 @@ int is_mapped(uintptr_t v) weak;
 int is_mapped(uintptr_t v) {
   return -1;
 }
+int zero_page(uint64_t p) weak;
+int zero_page(uint64_t p) {
+  return -1;
+}
+void *phys_to_virt(uint64_t p) weak;
+void *phys_to_virt(uint64_t p) {
+  return NULL;
+}
+uint64_t virt_to_phys(void *v) weak;
+uint64_t virt_to_phys(void *v) {
+  return ~0ULL;
+}
 
 int init_virtual_memory(uintptr_t *pages) weak;
 int init_virtual_memory(uintptr_t *pages) {
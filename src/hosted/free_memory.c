@@ -13,8 +13,7 @@ static int free_memory() {
 
   init_virtual_memory(NULL);
 
-  for (uint64_t i = MMAP_PHYS_BASE; i < MMAP_PHYS_END; i += 0x1000)
-    free_page(i-MMAP_PHYS_BASE);
+  pmm_add_range(0, MMAP_PHYS_END-MMAP_PHYS_BASE);
 
   return 0;
 }
@@ -2,6 +2,7 @@
 #include "mmap.h"
 #include "stdio.h"
 #include "string.h"
+#include "vmspace.h"
 
 /* FIXME: Find out why we need these workarounds and remove them. */
 #define __USE_MISC /* Workaround to get MAP_ANON defined */
@@ -14,6 +15,14 @@
 address_space_t *current, *kernel;
 static spinlock_t global_vmm_lock = SPINLOCK_RELEASED;
 
+/* Change the protection of the host mapping at 'v' to match 'flags'. */
+static void set_prot(uintptr_t v, unsigned flags) {
+  unsigned prot = ((flags & PAGE_WRITE) ? PROT_WRITE : 0) |
+    ((flags & PAGE_EXECUTE) ? PROT_EXEC : 0) | PROT_READ;
+  if (mprotect((void*)v, 0x1000, prot) == -1)
+    panic("mprotect() failed!");
+}
+
 int clone_address_space(address_space_t *dest, int make_cow) {
   spinlock_acquire(&current->lock);
   
@@ -22,8 +31,16 @@ int clone_address_space(address_space_t *dest, int make_cow) {
 
   if (make_cow) {
     for (unsigned i = 0; i < (1<<20); ++i) {
-      if (dest->a[i] & PAGE_WRITE)
-        dest->a[i] = (dest->a[i] & ~PAGE_WRITE) | PAGE_COW;
+      if (current->a[i] & (PAGE_WRITE|PAGE_COW)) {
+        /* Both address spaces now share the page, so both must take a
+           copy before writing to it. */
+        if (current->a[i] & PAGE_WRITE) {
+          current->a[i] = (current->a[i] & ~PAGE_WRITE) | PAGE_COW;
+          set_prot(i*0x1000, current->a[i] & 0xFFF);
+        }
+        page_ref(current->a[i] & 0xFFFFF000);
+        dest->a[i] = current->a[i];
+      }
     }
   }
 
@@ -66,6 +83,8 @@ static int map_one_page(uintptr_t v, uint64_t p, unsigned flags) {
   /* Sanity check - if CoW, disable write access. */
   if (flags & PAGE_COW)
     flags &= ~PAGE_WRITE;
+  /* There are no large pages in hosted mode. */
+  flags &= ~PAGE_LARGE;
 
   address_space_t *a = current;
   if (v >= MMAP_KERNEL_START)
@@ -89,7 +108,7 @@ static int map_one_page(uintptr_t v, uint64_t p, unsigned flags) {
       (void*)v)
     panic("mmap() failed!");
 
-  memcpy((uint8_t*)v, (uint8_t*)(p+MMAP_PHYS_BASE), 0x1000);
+  memcpy((uint8_t*)v, phys_to_virt(p), 0x1000);
 
   /* Now unmap and map again with the correct permissions! */
   if (munmap((void*)v, 0x1000) == -1)
@@ -150,7 +169,7 @@ uint64_t get_mapping(uintptr_t v, unsigned *flags) {
   address_space_t *a = current;
   if (v >= MMAP_KERNEL_START)
     a = kernel;
-  uint32_t *entry = &a->a[v>>12];
+  uint32_t *entry = &a->a[(uint32_t)v>>12];
 
   if (*entry == 0)
     return ~0ULL;
@@ -167,33 +186,67 @@ int is_mapped(uintptr_t v) {
   return get_mapping(v, &flags) != ~0ULL;
 }
 
+void *phys_to_virt(uint64_t p) {
+  if (p >= MMAP_PHYS_END - MMAP_PHYS_BASE)
+    return NULL;
+  return (void*)(uintptr_t)(p+MMAP_PHYS_BASE);
+}
+
+uint64_t virt_to_phys(void *v) {
+  uintptr_t x = (uintptr_t)v;
+  if (x < MMAP_PHYS_BASE || x >= MMAP_PHYS_END)
+    return ~0ULL;
+  return x - MMAP_PHYS_BASE;
+}
+
+int zero_page(uint64_t p) {
+  memset(phys_to_virt(p), 0, 0x1000);
+  return 0;
+}
+
 static void segv(int sig, siginfo_t *si, void *unused) {
   uintptr_t addr = (uintptr_t)si->si_addr;
 
   unsigned flags;
   uint32_t p = (uint32_t)get_mapping(addr, &flags);
 
+  /* The page may be part of a lazy allocation that has not been touched
+     yet. */
+  if (p == ~0U && vmspace_fault(addr) == 0)
+    return;
+
   if (p != ~0U && (flags & PAGE_COW)) {
     /* Page was marked copy-on-write. */
-    uint32_t p2 = (uint32_t)alloc_page(PAGE_REQ_UNDER4GB);
 
-    /* We have to copy the page. In order to avoid a costly and 
-       non-reentrant map/unmap pair to temporarily have them
-       both mapped into memory, copy first into a buffer on
-       the stack (this means the stack must be >4KB). */
-    static uint8_t buffer[4096];
+    /* If every other sharer has already taken its own copy, the page is
+       ours alone and can simply be made writable again. */
+    if (page_sole_owner(p)) {
+      address_space_t *a = (addr >= MMAP_KERNEL_START) ? kernel : current;
+      uint32_t *entry = &a->a[(uint32_t)addr>>12];
+      *entry = (*entry & ~PAGE_COW) | PAGE_WRITE;
+      set_prot(addr & ~0xFFFUL, *entry & 0xFFF);
+      return;
+    }
+
+    uint64_t p2 = alloc_page(PAGE_REQ_UNDER4GB);
+    if (p2 == ~0ULL)
+      panic("Out of memory during copy-on-write!");
 
+    /* Copy straight into the new page through the direct map; map() then
+       brings its contents in. */
     uint32_t v = addr & 0xFFFFF000;
-    memcpy(buffer, (uint8_t*)(uintptr_t)v, 0x1000);
-    
+    memcpy(phys_to_virt(p2), (uint8_t*)(uintptr_t)v, 0x1000);
+
     if (unmap(v, 1) == -1)
       panic("unmap() failed during copy-on-write!");
 
     if (map(v, p2, 1, (flags & ~PAGE_COW)|PAGE_WRITE) == -1)
       panic("map() failed during copy-on-write!");
 
-    memcpy((uint8_t*)(uintptr_t)v, buffer, 0x1000);
-
+    /* Drop our share of the original, freeing it if every other sharer
+       freed theirs while we copied. */
+    if (page_unref(p) == 0)
+      free_page(p);
     return;
   }
 
@@ -15,10 +15,14 @@
 
 #include "stdint.h"
 
+/** Number of blocks pointed to directly by the xbitmap_t. */
+#define XBITMAP_NDIRECT 8
+
 /** Allocator function type.
     @param sz The requested allocation size. This will be exactly @p blocksz given in the
               adt constructor.
-    @param p  Opaque parameter as passed to the constructor. */
+    @param p  Opaque parameter as passed to the constructor.
+    @return The new memory, or NULL if there is none. */
 typedef void* (*alloc_fn_t)(unsigned sz, void *p);
 
 /** Free function type.
@@ -31,9 +35,23 @@ typedef struct xbitmap {
   alloc_fn_t alloc;
   free_fn_t free;
   void *alloc_p;       /* Opaque value to pass to alloc and free */
+  int alloc_zeroed;    /* Nonzero if alloc returns zero-filled memory, so new
+                          blocks need not be cleared. Defaults to zero. */
+  int summary;         /* Nonzero to keep a summary of which words are
+                          nonzero, making xbitmap_first_set() cheap on large,
+                          sparse bitmaps at the cost of some space in each
+                          block. Must be set before any bit is set or
+                          cleared. Defaults to zero. */
 
   int blocksz;
-  uint8_t *firstblock; /* Pointer to the first block, or NULL */
+  /* Blocks are found through a small radix tree, so any bit can be reached
+     in constant time. The first XBITMAP_NDIRECT blocks are pointed to
+     directly, the next blocksz/sizeof(void*) through 'indirect', and the
+     rest through the two levels of 'dindirect'. Blocks and indirect blocks
+     are allocated on first write; missing blocks read as clear. */
+  uint8_t *direct[XBITMAP_NDIRECT];
+  uint8_t **indirect;
+  uint8_t ***dindirect;
   unsigned extent;     /* The largest index set/cleared so far */
 } xbitmap_t;
 
@@ -47,10 +65,12 @@ typedef struct xbitmap {
                    alloc/free functions. */
 void xbitmap_init(xbitmap_t *xb, int blocksz, alloc_fn_t alloc, free_fn_t free, void *alloc_p);
 
-/** Sets a bit at index @p idx. If this requires the bitmap be expanded, it will be. */
-void xbitmap_set(xbitmap_t *xb, unsigned idx);
+/** Sets a bit at index @p idx. If this requires the bitmap be expanded, it will be.
+    @return 0 on success, or -1 if the allocator failed. */
+int xbitmap_set(xbitmap_t *xb, unsigned idx);
 
-/** Clears a bit at index @p idx. If this requires the bitmap be expanded, it will be. */
+/** Clears a bit at index @p idx. Bits in blocks that were never allocated
+    are already clear, so this never expands the bitmap. */
 void xbitmap_clear(xbitmap_t *xb, unsigned idx);
 
 /** Predicate: returns nonzero if the bit at index @p idx is set. */
@@ -62,6 +82,59 @@ int xbitmap_isclear(xbitmap_t *xb, unsigned idx);
 /** Return the index of the first bit that is set, or -1 if no bits are set at all. */
 int xbitmap_first_set(xbitmap_t *xb);
 
+/** Sets the @p len bits starting at index @p idx.
+    @return 0 on success, or -1 if the allocator failed, in which case only
+            some of the bits may have been set. */
+int xbitmap_set_range(xbitmap_t *xb, unsigned idx, unsigned len);
+
+/** Clears the @p len bits starting at index @p idx. */
+void xbitmap_clear_range(xbitmap_t *xb, unsigned idx, unsigned len);
+
+/** Return the index of the first bit at or after @p idx that is set, or -1 if
+    there is none. */
+int xbitmap_find_next_set(xbitmap_t *xb, unsigned idx);
+
+/** Return the index of the first bit that is clear. As the bitmap has no
+    maximum bound, there always is one. */
+int xbitmap_find_first_clear(xbitmap_t *xb);
+
+/** Return the index of the first run of @p len consecutive clear bits. As the
+    bitmap has no maximum bound, there always is one, though it may start
+    past the largest index set so far. */
+int xbitmap_find_run(xbitmap_t *xb, unsigned len);
+
+/** Return the number of bits that are set. */
+unsigned xbitmap_popcount(xbitmap_t *xb);
+
+/** @name Atomic operations
+
+   These may be called concurrently with each other, and with the read-only
+   functions above, without a lock. They cannot be mixed with the non-atomic
+   mutators, and require the summary to be disabled. The alloc and free
+   functions must be safe to call concurrently: if two threads race to
+   create the same block, the loser's block is given back with the free
+   function.
+   @{ */
+
+/** Atomically sets the bit at index @p idx. */
+void xbitmap_atomic_set(xbitmap_t *xb, unsigned idx);
+
+/** Atomically clears the bit at index @p idx. */
+void xbitmap_atomic_clear(xbitmap_t *xb, unsigned idx);
+
+/** Atomically sets the bit at index @p idx, returning nonzero if it was
+    already set. */
+int xbitmap_atomic_test_and_set(xbitmap_t *xb, unsigned idx);
+
+/** Predicate: returns nonzero if the bit at index @p idx is set. */
+int xbitmap_atomic_isset(xbitmap_t *xb, unsigned idx);
+
+/** Atomically find the first clear bit below @p limit and set it, returning
+    its index, or -1 if every bit below @p limit is set. */
+int xbitmap_atomic_claim_first_clear(xbitmap_t *xb, unsigned limit);
+
+/** @} */
+
 /** @} */
 
 #endif
@@ -322,14 +322,23 @@ int unregister_callback(void (*cb)(void*));
 #define PAGE_USER    4 /* Page is useable by user mode code (else kernel only) */
 #define PAGE_COW     8 /* Page is marked copy-on-write. It must be copied if
                           written to. */
+#define PAGE_LARGE  16 /* Map using large pages where the virtual and physical
+                          addresses are aligned to get_large_page_size(). */
 
 #define PAGE_REQ_NONE     0 /* No requirements on page location */
 #define PAGE_REQ_UNDER1MB 1 /* Require that the returned page be < 0x100000 */
 #define PAGE_REQ_UNDER4GB 2 /* Require that the returned page be < 0x10000000 */
+#define PAGE_REQ_ZEROED   4 /* May be OR'd with one of the above: require that
+                               the returned page be zero-filled */
+#define PAGE_REQ_NOWAIT   8 /* May be OR'd with one of the above: fail rather
+                               than reclaim memory */
 
 /* Returns the (default) page size in bytes. Not all pages may be this size
    (large pages etc.) */
 unsigned get_page_size();
+/* Returns the size in bytes of a large page, as mapped by PAGE_LARGE, or 0
+   if large pages are not supported. */
+unsigned get_large_page_size();
 
 /* Allocate a physical page of the size returned by get_page_size(), returning
    the address of the page in the physical address space. Returns ~0ULL on
@@ -338,8 +347,91 @@ unsigned get_page_size();
    'req' is one of the 'PAGE_REQ_*' flags, indicating a requirement on the
    address of the returned page. */
 uint64_t alloc_page(int req);
-/* Mark a physical page as free. Returns -1 on failure. */
+/* Mark a physical page as free. If other mappings still share the page,
+   only this owner's reference is dropped and the page stays allocated.
+   Returns -1 on failure. */
 int free_page(uint64_t page);
+/* Allocate 'n' physical pages as alloc_page() would, storing their addresses
+   in 'pages'. The pages are not necessarily contiguous. Returns 0 on success,
+   or -1 if fewer than 'n' pages were available, in which case none are
+   allocated. */
+int alloc_pages(unsigned n, int req, uint64_t *pages);
+/* Mark the 'n' physical pages in 'pages' as free, as free_page() does.
+   Returns -1 on failure. */
+int free_pages(unsigned n, uint64_t *pages);
+/* Mark all pages in the physical range [base, base+len) as free. 'base'
+   is rounded up and 'base+len' rounded down to a page boundary. Pages are
+   handed out lazily, so this is cheap however large the range. Returns -1
+   on failure. */
+int pmm_add_range(uint64_t base, uint64_t len);
+/* Allocate 2^'order' physically contiguous pages, aligned to their total
+   size, returning the address of the first. Returns ~0ULL on failure.
+
+   'req' is one of the 'PAGE_REQ_*' flags. Contiguous memory is a scarce
+   resource, so this should only be used when it is really needed, for example
+   for DMA buffers or to back large pages. */
+uint64_t alloc_pages_contig(unsigned order, int req);
+/* Free a block allocated by alloc_pages_contig(). 'order' must be the same
+   as that given on allocation. Returns -1 on failure. */
+int free_pages_contig(uint64_t base, unsigned order);
+#define PAGE_CONTIG_MAX_ORDER 10 /* Largest order alloc_pages_contig() can
+                                    satisfy: 1024 pages (4MB). */
+
+/* A shrinker releases memory held by a cache when the physical memory
+   manager runs low. It should try to free about 'nr_pages' pages, preferring
+   those that satisfy the PAGE_REQ_* zone 'req', and return the number of
+   pages actually freed.
+
+   Shrinkers may be called from within an allocation, so must not block on
+   any lock the allocating thread may already hold. */
+typedef unsigned (*shrinker_fn_t)(unsigned nr_pages, int req);
+
+/* Register a shrinker. When a zone drops below its low watermark, or an
+   allocation would otherwise fail, shrinkers are called in turn until the
+   zone is back above its high watermark. Returns -1 on failure. */
+int register_shrinker(shrinker_fn_t fn);
+
+/* A snapshot of physical memory manager statistics. Per-zone arrays are
+   indexed by PAGE_REQ_UNDER1MB, PAGE_REQ_UNDER4GB and PAGE_REQ_NONE. */
+typedef struct pmm_stats {
+  uint64_t total_frames[3]; /* Frames ever registered in the zone. */
+  uint64_t free_frames[3];  /* Frames free, including any held in caches. */
+  unsigned reclaims[3];     /* Times the shrinkers were run for the zone. */
+
+  /* alloc_pages_contig() and free_pages_contig() calls, per order. */
+  unsigned contig_allocs[PAGE_CONTIG_MAX_ORDER+1];
+  unsigned contig_frees[PAGE_CONTIG_MAX_ORDER+1];
+} pmm_stats_t;
+
+/* Fill in 's' with the current physical memory statistics. Returns -1 on
+   failure. */
+int pmm_get_stats(pmm_stats_t *s);
+
+/* Per-frame metadata, kept in an array indexed by page frame number. */
+typedef struct page {
+  uint16_t refcount; /* Number of mappings sharing the page. 0 if the page is
+                        free or was allocated before descriptors were set
+                        up, in which case its sharing is unknown. */
+  uint8_t flags;     /* PAGE_DESC_* flags. */
+  uint8_t zone;      /* The PAGE_REQ_* zone the page was allocated from. */
+} page_t;
+
+#define PAGE_DESC_CONTIG 1 /* Page is part of an alloc_pages_contig() block. */
+
+/* Returns the descriptor for the physical page containing 'p', or NULL if
+   that page is not tracked. */
+page_t *get_page(uint64_t p);
+/* Add a reference to physical page 'p' because another mapping now shares
+   it. A page with an unknown refcount is assumed to have had one owner.
+   Returns the new refcount, or -1 if the page is not tracked. */
+int page_ref(uint64_t p);
+/* Drop a reference to physical page 'p'. The page is not freed when the
+   count reaches zero. Returns the new refcount, or -1 if the page is not
+   tracked or its refcount is unknown. */
+int page_unref(uint64_t p);
+/* Returns nonzero if physical page 'p' is tracked and has exactly one
+   owner, so a copy-on-write mapping of it may simply be made writable. */
+int page_sole_owner(uint64_t p);
 
 /* Creates a new address space based on the current one and stores it in
    'dest'. If 'make_cow' is nonzero, all pages marked WRITE are modified so
@@ -374,6 +466,18 @@ uint64_t get_mapping(uintptr_t v, unsigned *flags);
 /* Return 1 if 'v' is mapped, else 0, or -1 if not implemented. */
 int is_mapped(uintptr_t v);
 
+/* Fill the physical page 'p' with zeroes. It need not be mapped. Returns -1
+   on failure. */
+int zero_page(uint64_t p);
+
+/* Return a kernel virtual address through which the physical address 'p'
+   can be accessed directly, without mapping it, or NULL if 'p' lies outside
+   the direct map. */
+void *phys_to_virt(uint64_t p);
+/* The inverse of phys_to_virt(). Returns ~0ULL if 'v' is not an address in
+   the direct map. */
+uint64_t virt_to_phys(void *v);
+
 /* Initialise the virtual memory manager. 'pages' is an array of
    NUM_INITIAL_PAGES physical pages, which the VMM can use to
    bootstrap itself into a state where it can map more pages in the
@@ -616,6 +720,8 @@ void spinlock_init(spinlock_t *lock);
 spinlock_t *spinlock_new();
 /* Acquire 'lock', blocking until it is available. */
 void spinlock_acquire(spinlock_t *lock);
+/* Acquire 'lock' if it is available. Returns nonzero if it was acquired. */
+int spinlock_try_acquire(spinlock_t *lock);
 /* Release 'lock'. Nonblocking. */
 void spinlock_release(spinlock_t *lock);
 
@@ -13,6 +13,10 @@ static inline unsigned get_page_size() {
   return 4096;
 }
 
+static inline unsigned get_large_page_size() {
+  return 0;
+}
+
 struct regs {
 };
 
@@ -3,16 +3,25 @@
 
 #define MMAP_KERNEL_START 0xC0000000
 
+#define MMAP_PAGE_DESCS   0xC0400000
+#define MMAP_PAGE_DESCS_END \
+                          0xC0800000
+
+/* Physical memory is already directly mapped at MMAP_PHYS_BASE, outside
+   the kernel's window (see phys_to_virt), so the heap starts straight after
+   the page descriptors. */
 #define MMAP_KERNEL_VMSPACE_START \
-                          0xD0000000
+                          0xC0800000
 #define MMAP_KERNEL_VMSPACE_END \
-                          0xFEFF0000
+                          0xFF000000
 
 #define MMAP_PMM_STACK2   0xFF000000
 #define MMAP_PMM_STACK1   0xFF400000
 #define MMAP_PMM_STACK0   0xFF800000
 #define MMAP_PMM_STACKEND 0xFFBFF000
 
+/* The host mapping that backs "physical" memory. phys_to_virt and
+   virt_to_phys translate by this offset. */
 #define MMAP_PHYS_BASE (0x200000000UL)
 #define MMAP_PHYS_END  (0x201000000UL) /* 16MB */
 
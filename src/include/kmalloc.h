@@ -1,7 +1,27 @@
 #ifndef KMALLOC_H
 #define KMALLOC_H
 
+#include "slab.h"
+
+#define MAX_CACHESZ_LOG2 9 /* 2**9 = 512 */
+#define MIN_CACHESZ_LOG2 3 /* 2**3 = 8 */
+/* Number of slab caches kmalloc serves small allocations from. */
+#define KMALLOC_NUM_CACHES (MAX_CACHESZ_LOG2-MIN_CACHESZ_LOG2+1)
+
+/* A snapshot of kmalloc's statistics. */
+typedef struct kmalloc_stats {
+  /* The slab caches, smallest first. */
+  slab_cache_stats_t caches[KMALLOC_NUM_CACHES];
+  /* Allocations too large for a cache, served directly from the vmspace. */
+  unsigned large_allocs, large_frees;
+  /* Totals over all allocations so far. The difference between the two is
+     lost to the header and to rounding up to a power of two. */
+  uint64_t bytes_requested, bytes_allocated;
+} kmalloc_stats_t;
+
 void *kmalloc(unsigned sz);
 void kfree(void *p);
+/* Fill in 's' with the current kmalloc statistics. */
+void kmalloc_get_stats(kmalloc_stats_t *s);
 
 #endif
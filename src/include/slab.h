@@ -5,19 +5,110 @@
 
 #define SLAB_SIZE 0x2000
 
+/* Number of empty slabs a cache keeps by default, rather than returning
+   them to its vmspace. */
+#define SLAB_DEFAULT_MAX_EMPTY 1
+
+/* Number of objects a magazine holds. */
+#define SLAB_MAGAZINE_SZ 14
+
+/* A magazine: a stack of free objects, cached in front of the slabs. */
+typedef struct slab_magazine {
+  /* Next magazine in the depot. */
+  struct slab_magazine *next;
+  unsigned n;
+  void *objs[SLAB_MAGAZINE_SZ];
+} slab_magazine_t;
+
+/* The magazines a core is working from. It is only ever touched by its
+   owning core with interrupts disabled, so needs no lock. 'previous' is
+   always either full or empty. */
+typedef struct slab_cpu {
+  slab_magazine_t *loaded, *previous;
+  /* Allocations served from a magazine, and those that went to the
+     slabs. */
+  unsigned hits, misses;
+} slab_cpu_t;
+
+/* Object constructor and destructor. A constructor sets up an object's
+   invariant state, and runs once before the object is first handed out;
+   the destructor undoes it before the object's slab is released. */
+typedef void (*slab_ctor_fn_t)(void *obj);
+typedef void (*slab_dtor_fn_t)(void *obj);
+
 typedef struct slab_cache {
   unsigned size;
-  void *init;
-  struct slab_footer *first;
-  void *empty;
+  /* Number of objects in each slab. */
+  unsigned objs_per_slab;
+  slab_ctor_fn_t ctor;
+  slab_dtor_fn_t dtor;
+  /* Slabs with some, all and none of their objects allocated. */
+  struct slab_footer *partial, *full_slabs, *empty_slabs;
+  /* Number of empty slabs held, and the most that will be held before
+     they are returned to the vmspace. */
+  unsigned nempty, max_empty;
   vmspace_t *vms;
+  /* Next cache in the list of all caches, for the shrinker. */
+  struct slab_cache *next;
+  /* Number of slabs, and of objects allocated from them (including those
+     sitting in magazines). */
+  unsigned nslabs, in_use;
+  /* Slabs created and destroyed over the cache's lifetime. */
+  unsigned created, destroyed;
+  /* Number of distinct offsets new slabs start their objects at, and the
+     one the next slab gets. Protected by 'lock'. */
+  unsigned ncolors, next_color;
 
   spinlock_t lock;
+
+  /* Per-core magazines, and the depot of full and empty magazines they are
+     exchanged with. Magazines are carved out of pages on the 'mag_pages'
+     list. The depot is protected by 'depot_lock', which is never taken
+     while 'lock' is held. */
+  slab_cpu_t cpus[MAX_CORES];
+  slab_magazine_t *full, *empties;
+  unsigned nfull;
+  void *mag_pages;
+  spinlock_t depot_lock;
 } slab_cache_t;
 
-int slab_cache_create(slab_cache_t *c, vmspace_t *vms, unsigned size, void *init);
+/* A snapshot of a cache's statistics. */
+typedef struct slab_cache_stats {
+  unsigned size;          /* Object size in bytes. */
+  unsigned slabs;         /* Slabs currently allocated. */
+  unsigned empty;         /* Of which, empty slabs kept for reuse. */
+  unsigned created;       /* Slabs created so far. */
+  unsigned destroyed;     /* Slabs destroyed so far. */
+  unsigned objs_per_slab; /* Objects that fit in one slab. */
+  unsigned in_use;        /* Objects currently allocated. */
+  unsigned cached;        /* Free objects held in magazines. */
+  unsigned hits, misses;  /* Allocations served by magazines, and not. */
+} slab_cache_stats_t;
+
+/* Create a cache of objects of 'size' bytes, with slabs allocated from
+   'vms'. Either of 'ctor' and 'dtor' may be NULL.
+
+   Objects from a cache with a constructor are returned by
+   slab_cache_alloc in constructed state, and must be in constructed state
+   again when passed to slab_cache_free, so that invariant fields need not
+   be reinitialised on every allocation. */
+int slab_cache_create(slab_cache_t *c, vmspace_t *vms, unsigned size,
+                      slab_ctor_fn_t ctor, slab_dtor_fn_t dtor);
 int slab_cache_destroy(slab_cache_t *c);
 void *slab_cache_alloc(slab_cache_t *c);
 void slab_cache_free(slab_cache_t *c, void *obj);
+/* Set the number of empty slabs 'c' keeps for reuse, destroying any held
+   beyond the new limit. */
+void slab_cache_set_max_empty(slab_cache_t *c, unsigned n);
+/* Return everything 'c' holds that is not in use to its vmspace: the
+   objects in its depot's full magazines, and then its empty slabs. The
+   per-core magazines are left alone. Returns the number of pages freed.
+   Must not be called with any of the cache's locks held. */
+unsigned slab_cache_shrink(slab_cache_t *c);
+/* Call slab_cache_shrink on every cache, returning the total number of
+   pages freed. Must not run concurrently with slab_cache_destroy. */
+unsigned slab_cache_reap();
+/* Fill in 's' with the current statistics for 'c'. */
+void slab_cache_get_stats(slab_cache_t *c, slab_cache_stats_t *s);
 
 #endif
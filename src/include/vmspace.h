@@ -8,17 +8,148 @@
 #define MAX_BUDDY_SZ_LOG2 28 /* 2^28 = 256MB */
 /* log2 of the minimum buddy node size. */
 #define MIN_BUDDY_SZ_LOG2 12 /* 2^12 = 4KB */
+/* Number of buddy orders. */
+#define VMSPACE_NUM_ORDERS (MAX_BUDDY_SZ_LOG2-MIN_BUDDY_SZ_LOG2+1)
+
+/* May be OR'd into vmspace_alloc's 'alloc_phys' flags to back the allocation
+   with zero-filled pages. */
+#define VMSPACE_ZEROED 0x100
+/* May be OR'd into vmspace_alloc's 'alloc_phys' flags to only reserve the
+   range. Each page is backed with a zero-filled page, mapped with the
+   remaining flags, when it is first touched. */
+#define VMSPACE_LAZY   0x200
+
+/* Bits kept per page in a vmspace's 'lazy' bitmap: whether the page is part
+   of a lazy allocation, and the PAGE_* flags to map it with. */
+#define VMSPACE_LAZY_BITS 4
+
+/* A free list link. Blocks are named by their address shifted right by
+   their order's log2 size, so buddy blocks are always naturally aligned. */
+typedef struct vmspace_link {
+  uint32_t next;
+  uint32_t prev : 31;
+  /* Set if the block is free. This is how a block's buddy is found to be
+     free. */
+  uint32_t is_free : 1;
+} vmspace_link_t;
+
+/* Terminates a free list. */
+#define VMSPACE_NIL (~0U)
+
+/* Number of segregated free lists in an extent vmspace. List i holds the
+   free extents of between 2^i and 2^(i+1)-1 pages. */
+#define VMSPACE_EXTENT_LISTS (32-MIN_BUDDY_SZ_LOG2)
+
+/* A boundary tag, one per page of an extent vmspace. 'tag' is the size in
+   pages of the extent the page begins or ends, shifted left by one, with
+   the low bit set if the extent is free; it is only meaningful in an
+   extent's first and last page. next/prev link a free extent into its free
+   list, by first page, and are only meaningful in a free extent's first
+   page. */
+typedef struct vmspace_tag {
+  uint32_t tag;
+  uint32_t next, prev;
+} vmspace_tag_t;
+
+/* Quantum caches are kept for allocations of 1 to VMSPACE_QCACHE_MAX pages,
+   each holding up to VMSPACE_QCACHE_DEPTH ranges. */
+#define VMSPACE_QCACHE_MAX   8
+#define VMSPACE_QCACHE_DEPTH 16
+
+/* A quantum cache: a stack of recently freed ranges of one size, handed
+   straight back out to the next allocation of that size. Each cache has its
+   own lock, so hits never touch the vmspace's lock or its free lists. */
+typedef struct vmspace_qcache {
+  uintptr_t addrs[VMSPACE_QCACHE_DEPTH];
+  unsigned n;
+  /* Statistics. Protected by 'lock'. */
+  unsigned hits, misses;
+  spinlock_t lock;
+} vmspace_qcache_t;
 
 typedef struct vmspace {
   uintptr_t start, size;
-  xbitmap_t orders[MAX_BUDDY_SZ_LOG2-MIN_BUDDY_SZ_LOG2+1];
-  uintptr_t order_alloc_ptrs[MAX_BUDDY_SZ_LOG2-MIN_BUDDY_SZ_LOG2+1];
+
+  /* The free blocks of each order, as a circular doubly linked list threaded
+     through links[order][block index - index of the first block that
+     overlaps the vmspace]. Free blocks need not be mapped, so the links
+     cannot live inside them; the arrays are mapped on demand instead.
+     free_heads[order] is VMSPACE_NIL if there are none. */
+  vmspace_link_t *links[VMSPACE_NUM_ORDERS];
+  unsigned free_heads[VMSPACE_NUM_ORDERS];
+
+  /* Nonzero if this vmspace hands out exact page-multiple extents instead
+     of buddy blocks (see vmspace_init_extents). In that mode the fields
+     above are unused, and 'tags' holds one boundary tag for each of the
+     'npages' pages, mapped on demand. */
+  int extents;
+  unsigned npages;
+  vmspace_tag_t *tags;
+  unsigned extent_heads[VMSPACE_EXTENT_LISTS];
+
+  /* qcaches[n-1] caches ranges of n pages, for n up to qcache_max. Zero
+     disables quantum caching. */
+  unsigned qcache_max;
+  vmspace_qcache_t qcaches[VMSPACE_QCACHE_MAX];
+
+  /* VMSPACE_LAZY_BITS bits per page, describing pages that are reserved
+     but will only be backed when they fault. Its blocks are allocated from
+     the vmspace itself. Protected by 'lock'. */
+  xbitmap_t lazy;
+  /* Links the vmspaces that have made lazy allocations, for
+     vmspace_fault(). */
+  struct vmspace *next_lazy;
+  int on_lazy_list;
+
+  /* Statistics, per order. Protected by 'lock'. In extent mode an extent
+     is counted against the order of its size rounded down (free extents)
+     or up (allocs and frees), clamped to the largest order. */
+  unsigned nfree[VMSPACE_NUM_ORDERS];
+  unsigned allocs[VMSPACE_NUM_ORDERS], frees[VMSPACE_NUM_ORDERS];
+
   spinlock_t lock;
 } vmspace_t;
 
+/* A snapshot of a vmspace's statistics, indexed by order (log2 of the block
+   size minus MIN_BUDDY_SZ_LOG2). */
+typedef struct vmspace_stats {
+  unsigned free_blocks[VMSPACE_NUM_ORDERS];
+  unsigned allocs[VMSPACE_NUM_ORDERS], frees[VMSPACE_NUM_ORDERS];
+  /* Quantum cache hits, misses and ranges held, indexed by size in pages
+     minus one. */
+  unsigned qcache_hits[VMSPACE_QCACHE_MAX], qcache_misses[VMSPACE_QCACHE_MAX];
+  unsigned qcache_cached[VMSPACE_QCACHE_MAX];
+} vmspace_stats_t;
+
+/* Initialise 'vms' to manage the 'sz' bytes at 'addr', both of which need
+   only be page aligned. Returns -1 if they are not, or if the range is too
+   small to hold the vmspace's own metadata. */
 int vmspace_init(vmspace_t *vms, uintptr_t addr, uintptr_t sz);
+/* As vmspace_init, but hand out extents of exactly the size asked for
+   (rounded up to a page), rather than power-of-two blocks. Extents are not
+   naturally aligned, and there is no upper limit on their size other than
+   the size of the vmspace. Adjacent free extents are coalesced. */
+int vmspace_init_extents(vmspace_t *vms, uintptr_t addr, uintptr_t sz);
+/* Allocate 'sz' bytes of address space. If 'alloc_phys' is nonzero, back it
+   with physical pages mapped with 'alloc_phys' as the PAGE_* flags (now, or
+   on first touch if VMSPACE_LAZY is given). Returns 0 if there is not enough
+   virtual or physical memory. */
 uintptr_t vmspace_alloc(vmspace_t *vms, unsigned sz, int alloc_phys);
+/* Free 'sz' bytes at 'addr'. If 'free_phys' is nonzero, unmap and free the
+   pages backing it. A lazy allocation always has whatever pages were
+   faulted in freed. */
 void vmspace_free(vmspace_t *vms, unsigned sz, uintptr_t addr, int free_phys);
+/* Cache recently freed ranges of up to 'max_pages' pages (at most
+   VMSPACE_QCACHE_MAX) per size, so that common small allocations bypass the
+   underlying allocator. The 'allocs' and 'frees' statistics then only count
+   the allocations that reach it. */
+void vmspace_enable_qcache(vmspace_t *vms, unsigned max_pages);
+/* Called by the page fault handler when 'addr' is not mapped. If it is part
+   of a lazy allocation, back it with a zero-filled page and return 0,
+   otherwise return -1. */
+int vmspace_fault(uintptr_t addr);
+/* Fill in 's' with the current statistics for 'vms'. */
+void vmspace_get_stats(vmspace_t *vms, vmspace_stats_t *s);
 
 extern vmspace_t kernel_vmspace;
 
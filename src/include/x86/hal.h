@@ -14,6 +14,14 @@ static inline unsigned get_page_size() {
   return 4096;
 }
 
+/* 4MB if the CPU supports large pages (PSE), otherwise 0. Set by
+   init_virtual_memory(). */
+extern unsigned x86_large_page_size;
+
+static inline unsigned get_large_page_size() {
+  return x86_large_page_size;
+}
+
 #include "x86/regs.h"
 
 struct jmp_buf_impl {
@@ -132,6 +132,8 @@ typedef struct ide_dev {
      Once this reaches zero, the next IRQ signifies the entire operation
      is complete. */
   unsigned n;
+  /* The index of the PRDT entry the current ATA command is transferring. */
+  unsigned cur;
   /* At the end of an operation, this semaphore should be signalled. */
   semaphore_t *sema;
   /* Lock for this device's bus. */
@@ -144,7 +146,9 @@ typedef struct ide_dev {
    a subpart of a DMA operation. Each PRDT entry specifies a (contiguous)
    physical memory address and a size.
 
-   We generally set this up so every entry specifies a 4096-byte page.
+   Physically contiguous pages of the buffer are merged into one entry, up to
+   the 64KB an entry can describe (an nbytes of zero means 64KB). An entry
+   may not cross a 64KB boundary.
 
    The last entry in the table is marked by its resvd field set to
    IDE_PRDT_LAST. */
@@ -7,6 +7,7 @@
 
 #define CR0_PG  (1U<<31)  /* Paging enable */
 #define CR0_WP  (1U<<16)  /* Write-protect - allow page faults in kernel mode */
+#define CR4_PSE (1U<<4)   /* Page size extensions - allow 4MB pages */
 
 static inline void outb(uint16_t port, uint8_t value) {
   __asm__ volatile ("outb %1, %0" : : "dN" (port), "a" (value));
@@ -53,6 +54,11 @@ static inline uint32_t read_cr3() {
   __asm__ volatile("mov %%cr3, %0" : "=r" (ret));
   return ret;
 }
+static inline uint32_t read_cr4() {
+  uint32_t ret;
+  __asm__ volatile("mov %%cr4, %0" : "=r" (ret));
+  return ret;
+}
 
 static inline void write_cr0(uint32_t val) {
   __asm__ volatile("mov %0, %%cr0" : : "r" (val));
@@ -63,6 +69,9 @@ static inline void write_cr2(uint32_t val) {
 static inline void write_cr3(uint32_t val) {
   __asm__ volatile("mov %0, %%cr3" : : "r" (val));
 }
+static inline void write_cr4(uint32_t val) {
+  __asm__ volatile("mov %0, %%cr4" : : "r" (val));
+}
 
 
 #endif
@@ -3,13 +3,23 @@
 
 #define MMAP_KERNEL_START 0xC0000000
 
+#define MMAP_PAGE_DESCS   0xC0400000
+#define MMAP_PAGE_DESCS_END \
+                          0xC0800000
+
+/* Physical memory below MMAP_DIRECT_END - MMAP_DIRECT is mapped linearly
+   here with large pages. Without large pages (PSE) it is left unmapped. */
+#define MMAP_DIRECT       0xC0800000
+#define MMAP_DIRECT_END   0xD0000000
+
 #define MMAP_KERNEL_VMSPACE_START \
                           0xD0000000
 #define MMAP_KERNEL_VMSPACE_END \
-                          0xFEFF0000
+                          0xFEFFE000
 
-#define MMAP_KERNEL_TMP1  0xFEFFE000
-#define MMAP_KERNEL_TMP2  0xFEFFF000
+/* Two pages of windows for reaching physical memory beyond the direct
+   map. */
+#define MMAP_KERNEL_SCRATCH 0xFEFFE000
 #define MMAP_PMM_STACK2   0xFF000000
 #define MMAP_PMM_STACK1   0xFF400000
 #define MMAP_PMM_STACK0   0xFF800000
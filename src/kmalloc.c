@@ -4,22 +4,26 @@
 #include "math.h"
 #include "mmap.h"
 #include "slab.h"
+#include "stdio.h"
 #include "vmspace.h"
 
-#define MAX_CACHESZ_LOG2 9 /* 2**9 = 512 */
-#define MIN_CACHESZ_LOG2 3 /* 2**3 = 8 */
-
 #define KMALLOC_CANARY 0xDEAD12
 
 vmspace_t kernel_vmspace;
 
-static slab_cache_t caches[MAX_CACHESZ_LOG2-MIN_CACHESZ_LOG2+1];
+static slab_cache_t caches[KMALLOC_NUM_CACHES];
+
+/* Statistics, protected by stats_lock. */
+static unsigned large_allocs, large_frees;
+static uint64_t bytes_requested, bytes_allocated;
+static spinlock_t stats_lock = SPINLOCK_RELEASED;
 
 void *kmalloc(unsigned sz) {
   /* We need to add a small header to the allocation to track which
      cache (if any) it came from. It must be a multiple of the pointer
      size in order that the address after it (which we will be returning)
      has natural alignment. */
+  unsigned requested = sz;
   sz += sizeof(uintptr_t);
 
   uintptr_t *ptr;
@@ -39,6 +43,15 @@ void *kmalloc(unsigned sz) {
 
     ptr = (uintptr_t*)vmspace_alloc(&kernel_vmspace, sz_p2, 1);
   }
+  if (!ptr)
+    return NULL;
+
+  spinlock_acquire(&stats_lock);
+  if (l2 > MAX_CACHESZ_LOG2)
+    ++large_allocs;
+  bytes_requested += requested;
+  bytes_allocated += 1U << l2;
+  spinlock_release(&stats_lock);
 
   ptr[0] = (KMALLOC_CANARY << 8) | l2;
   return &ptr[1];
@@ -53,33 +66,100 @@ void kfree(void *p) {
 
   assert(canary == KMALLOC_CANARY && "Heap corruption!");
 
-  if (l2 <= MAX_CACHESZ_LOG2)
+  if (l2 <= MAX_CACHESZ_LOG2) {
     slab_cache_free(&caches[l2-MIN_CACHESZ_LOG2], p);
-  else
+  } else {
     vmspace_free(&kernel_vmspace, (1U << l2), (uintptr_t)p, 1);
+
+    spinlock_acquire(&stats_lock);
+    ++large_frees;
+    spinlock_release(&stats_lock);
+  }
+}
+
+void kmalloc_get_stats(kmalloc_stats_t *s) {
+  for (unsigned i = 0; i < KMALLOC_NUM_CACHES; ++i)
+    slab_cache_get_stats(&caches[i], &s->caches[i]);
+
+  spinlock_acquire(&stats_lock);
+  s->large_allocs = large_allocs;
+  s->large_frees = large_frees;
+  s->bytes_requested = bytes_requested;
+  s->bytes_allocated = bytes_allocated;
+  spinlock_release(&stats_lock);
+}
+
+static void meminfo(const char *cmd, core_debug_state_t *states, int core) {
+  static const char *names[3] = {"none", "<1MB", "<4GB"};
+
+  pmm_stats_t ps;
+  if (pmm_get_stats(&ps) == 0) {
+    for (int req = 0; req < 3; ++req)
+      kprintf("pmm %s: %u/%u frames free, %u reclaims\n", names[req],
+              (unsigned)ps.free_frames[req], (unsigned)ps.total_frames[req],
+              ps.reclaims[req]);
+    for (unsigned i = 0; i <= PAGE_CONTIG_MAX_ORDER; ++i)
+      if (ps.contig_allocs[i] || ps.contig_frees[i])
+        kprintf("pmm contig order %u: %u allocs, %u frees\n", i,
+                ps.contig_allocs[i], ps.contig_frees[i]);
+  }
+
+  vmspace_stats_t vs;
+  vmspace_get_stats(&kernel_vmspace, &vs);
+  for (unsigned i = 0; i < VMSPACE_NUM_ORDERS; ++i)
+    if (vs.free_blocks[i] || vs.allocs[i] || vs.frees[i])
+      kprintf("vmspace %u bytes: %u free blocks, %u allocs, %u frees\n",
+              1U << (i+MIN_BUDDY_SZ_LOG2), vs.free_blocks[i], vs.allocs[i],
+              vs.frees[i]);
+  for (unsigned i = 0; i < VMSPACE_QCACHE_MAX; ++i) {
+    unsigned total = vs.qcache_hits[i] + vs.qcache_misses[i];
+    if (total)
+      kprintf("vmspace qcache %u pages: %u/%u hits (%u%%), %u cached\n", i+1,
+              vs.qcache_hits[i], total, vs.qcache_hits[i] * 100 / total,
+              vs.qcache_cached[i]);
+  }
+
+  kmalloc_stats_t ks;
+  kmalloc_get_stats(&ks);
+  for (unsigned i = 0; i < KMALLOC_NUM_CACHES; ++i) {
+    slab_cache_stats_t *c = &ks.caches[i];
+    kprintf("kmalloc-%u: %u slabs (%u empty), %u/%u objects in use, "
+            "%u cached, %u/%u magazine hits, %u slabs created\n", c->size,
+            c->slabs, c->empty, c->in_use, c->slabs * c->objs_per_slab,
+            c->cached, c->hits, c->hits + c->misses, c->created);
+  }
+  kprintf("kmalloc large: %u allocs, %u frees\n", ks.large_allocs,
+          ks.large_frees);
+  kprintf("kmalloc: %uKB requested, %uKB wasted to rounding\n",
+          (unsigned)(ks.bytes_requested / 1024),
+          (unsigned)((ks.bytes_allocated - ks.bytes_requested) / 1024));
 }
 
 static int kmalloc_init() {
-  /* FIXME: Make vmspace_init deal with addresses that aren't initially
-     maximally aligned so we can give it 0xC0400000 as the starting
-     address (first address after first 4MB identity map (x86)) */
   if (vmspace_init(&kernel_vmspace,
                    MMAP_KERNEL_VMSPACE_START,
                    MMAP_KERNEL_VMSPACE_END-MMAP_KERNEL_VMSPACE_START) == -1) {
     assert(0 && "kernel_vmspace init failed!");
     return -1;
   }
+  /* Slabs, thread stacks and page-sized kmallocs all come in a few small
+     sizes. */
+  vmspace_enable_qcache(&kernel_vmspace, VMSPACE_QCACHE_MAX);
 
   int r = 0;
   for (unsigned i = 0; i <= MAX_CACHESZ_LOG2-MIN_CACHESZ_LOG2; ++i)
-    r |= slab_cache_create(&caches[i], &kernel_vmspace, 1U<<(i+MIN_CACHESZ_LOG2), NULL);
+    r |= slab_cache_create(&caches[i], &kernel_vmspace,
+                           1U<<(i+MIN_CACHESZ_LOG2), NULL, NULL);
 
   assert(r == 0  && "slab cache creation failed!");
 
+  register_debugger_handler("meminfo", "Print memory usage statistics",
+                            &meminfo);
   return r;
 }
 
-static const char *prereqs[] = {"x86/free_memory", "hosted/free_memory", NULL};
+static const char *prereqs[] = {"debugger", "x86/free_memory",
+                                "hosted/free_memory", NULL};
 static init_fini_fn_t x run_on_startup = {
   .name = "kmalloc",
   .prerequisites = prereqs,
@@ -15,6 +15,17 @@ void spinlock_acquire(spinlock_t *lock) {
     ;
 }
 
+int spinlock_try_acquire(spinlock_t *lock) {
+  int ints = get_interrupt_state();
+  disable_interrupts();
+  if (__sync_bool_compare_and_swap(&lock->val, 0, 1) == 0) {
+    set_interrupt_state(ints);
+    return 0;
+  }
+  lock->interrupts = ints;
+  return 1;
+}
+
 void spinlock_release(spinlock_t *lock) {
   lock->val = 0;
   set_interrupt_state(lock->interrupts);
@@ -1,5 +1,14 @@
 #include "hal.h"
 #include "mmap.h"
+#include "stdio.h"
+#include "string.h"
+#include "thread.h"
+
+/* Number of frames a per-core magazine can hold. */
+#define MAGAZINE_SZ 32
+/* Number of frames moved between a magazine and the global stacks in one
+   go when the magazine runs empty or full. */
+#define MAGAZINE_BATCH (MAGAZINE_SZ/2)
 
 static spinlock_t lock = SPINLOCK_RELEASED;
 
@@ -15,6 +24,122 @@ static stack_t stacks[3] = {
   {.base = (uint64_t*)MMAP_PMM_STACK2, .addr = 0, .limit = 0,
    .max = (uint64_t*)MMAP_PMM_STACKEND} };
 
+/* A small per-core cache of free frames for one stack. It is only ever
+   touched by its owning core with interrupts disabled, so needs no lock. */
+typedef struct magazine {
+  unsigned n;
+  uint64_t frames[MAGAZINE_SZ];
+
+  /* Allocations served without taking the global lock, and those that
+     had to refill from the stacks first. */
+  unsigned hits, misses;
+  /* Number of times the magazine was drained back to the stacks. */
+  unsigned drains;
+} magazine_t;
+
+static magazine_t magazines[MAX_CORES][3];
+
+/* Number of pages in each physically contiguous region, per stack. Each
+   must be a power of two no larger than 1 << PAGE_CONTIG_MAX_ORDER. */
+#define CONTIG_REGION_PAGES (1U << PAGE_CONTIG_MAX_ORDER)
+#define CONTIG_REGION_PAGES_UNDER1MB 32
+
+/* Maximum number of contiguous regions each stack can have. */
+#define MAX_CONTIG_REGIONS 16
+/* Regions are carved until they hold 1/8th of the memory registered for the
+   stack, or at least one region if any range can hold it. */
+#define CONTIG_POOL_DIV 8
+
+/* A naturally aligned run of physical frames managed by a binary buddy
+   allocator, for callers that need physically contiguous memory.
+
+   Regions are carved out of the ranges given to pmm_add_range() as they
+   are registered, and never removed. Once set up, base and npages never
+   change, so membership can be tested without the lock. */
+typedef struct contig {
+  uint64_t base;
+  unsigned npages, max_pages, max_order;
+  /* Number of free pages in the region. */
+  unsigned nfree;
+
+  /* One bit per block per order, set if that block is free. Order 'k' starts
+     at bit CONTIG_BM_OFFSET(max_pages, k). */
+  uint32_t bitmap[2*CONTIG_REGION_PAGES/32];
+} contig_t;
+
+#define CONTIG_BM_OFFSET(n, k) (2*(n) - ((2*(n)) >> (k)))
+
+static contig_t contigs[3][MAX_CONTIG_REGIONS];
+static unsigned num_contigs[3];
+
+static const unsigned contig_region_pages[3] = {
+  CONTIG_REGION_PAGES, CONTIG_REGION_PAGES_UNDER1MB, CONTIG_REGION_PAGES};
+static const unsigned contig_region_order[3] = {
+  PAGE_CONTIG_MAX_ORDER, 5, PAGE_CONTIG_MAX_ORDER};
+
+/* Maximum number of free ranges each stack can track. */
+#define MAX_RANGES 32
+
+/* A run of free frames registered with pmm_add_range() that has not yet been
+   handed out. Frames are taken lazily from the top of the range, so
+   registering memory costs nothing per frame. */
+typedef struct range {
+  uint64_t base, end;
+} range_t;
+
+static range_t ranges[3][MAX_RANGES];
+static unsigned num_ranges[3];
+
+/* Total frames ever registered for each stack, and the watermarks derived
+   from it. Dropping below the low watermark triggers reclaim, which runs
+   the shrinkers until the high watermark is reached again. */
+static uint64_t total_frames[3];
+static unsigned wmark_low[3], wmark_high[3];
+#define WMARK_LOW_DIV  64 /* Low watermark is 1/64th of the zone. */
+#define WMARK_HIGH_DIV 32 /* High watermark is 1/32nd of the zone. */
+
+#define MAX_SHRINKERS 16
+static shrinker_fn_t shrinkers[MAX_SHRINKERS];
+static unsigned num_shrinkers = 0;
+static spinlock_t shrinker_lock = SPINLOCK_RELEASED;
+/* Nonzero while a reclaim is in progress, so that shrinkers that allocate
+   do not recurse into it. */
+static volatile unsigned reclaiming = 0;
+/* Number of reclaims run, and pages they freed, per stack. */
+static unsigned reclaims[3], reclaimed[3];
+/* Number of contiguous blocks allocated and freed, per order. Protected by
+   the lock. */
+static unsigned contig_allocs[PAGE_CONTIG_MAX_ORDER+1];
+static unsigned contig_frees[PAGE_CONTIG_MAX_ORDER+1];
+
+/* Number of pre-zeroed frames kept for each stack. */
+#define ZERO_POOL_SZ 64
+/* Wake the zeroing thread when a pool drops below this many frames. */
+#define ZERO_POOL_LOW (ZERO_POOL_SZ/2)
+
+/* Frames zeroed ahead of time by the zeroing thread, so that PAGE_REQ_ZEROED
+   allocations need not touch the page. There is no pool for memory under
+   1MB; it is too scarce to set aside. Protected by zero_lock. */
+typedef struct zero_pool {
+  unsigned n;
+  uint64_t frames[ZERO_POOL_SZ];
+
+  /* Zeroed allocations served from the pool, and those that had to zero a
+     page on the spot. */
+  unsigned hits, misses;
+} zero_pool_t;
+
+static zero_pool_t zero_pools[3];
+static spinlock_t zero_lock = SPINLOCK_RELEASED;
+static thread_t *zero_thread = NULL;
+
+/* The page descriptor array, indexed by page frame number. It is mapped at
+   MMAP_PAGE_DESCS by pmm_init() once all memory has been registered, and
+   covers every frame below 'phys_end'. Until then it is NULL. */
+static page_t *page_descs = NULL;
+static uint64_t num_page_descs = 0;
+static uint64_t phys_end = 0;
+
 static void stack_push(stack_t *stack, uint64_t value) {
   if (stack->addr == 0) {
     if (map((uintptr_t)stack->base, value, 1, PAGE_WRITE) == -1)
@@ -34,36 +159,872 @@ static void stack_push(stack_t *stack, uint64_t value) {
 static uint64_t stack_pop(stack_t *stack) {
   if (stack->addr == 0)
     return ~0ULL;
-  
+
   if (stack->addr == stack->base)
     return ~0ULL;
   return *--stack->addr;
 }
 
-uint64_t alloc_page(int req) {
-  spinlock_acquire(&lock);
-  
+/* Return the stack index that 'page' belongs on. */
+static int page_req(uint64_t page) {
+  if (page < 0x100000)
+    return PAGE_REQ_UNDER1MB;
+  else if (sizeof(void*) == 4 || page < 0x10000000UL)
+    return PAGE_REQ_UNDER4GB;
+  else
+    return PAGE_REQ_NONE;
+}
+
+/* Return the lowest address above 'page' that belongs on a different stack,
+   or ~0ULL if there is none. */
+static uint64_t page_req_limit(uint64_t page) {
+  if (page < 0x100000)
+    return 0x100000;
+  else if (sizeof(void*) == 8 && page < 0x10000000UL)
+    return 0x10000000UL;
+  else
+    return ~0ULL;
+}
+
+static int contig_test(contig_t *c, unsigned order, unsigned idx) {
+  unsigned bit = CONTIG_BM_OFFSET(c->max_pages, order) + idx;
+  return (c->bitmap[bit/32] >> (bit%32)) & 1;
+}
+
+static void contig_set(contig_t *c, unsigned order, unsigned idx, int val) {
+  unsigned bit = CONTIG_BM_OFFSET(c->max_pages, order) + idx;
+  if (val)
+    c->bitmap[bit/32] |= 1U << (bit%32);
+  else
+    c->bitmap[bit/32] &= ~(1U << (bit%32));
+}
+
+static int contig_contains(contig_t *c, uint64_t page) {
+  return c->npages > 0 && page >= c->base &&
+    page < c->base + (uint64_t)c->npages * get_page_size();
+}
+
+/* Return the contiguous region holding 'page', or NULL if there is none. */
+static contig_t *contig_find(uint64_t page) {
+  int req = page_req(page);
+  for (unsigned i = 0; i < num_contigs[req]; ++i)
+    if (contig_contains(&contigs[req][i], page))
+      return &contigs[req][i];
+  return NULL;
+}
+
+/* Return the block of 2^'order' pages at 'page' to the region, merging it
+   with its buddy as far as possible. The lock must be held. */
+static void contig_free_locked(contig_t *c, uint64_t page, unsigned order) {
+  unsigned idx = (unsigned)((page - c->base) / get_page_size()) >> order;
+  c->nfree += 1U << order;
+
+  while (order < c->max_order && contig_test(c, order, idx ^ 1)) {
+    contig_set(c, order, idx ^ 1, 0);
+    idx >>= 1;
+    ++order;
+  }
+  contig_set(c, order, idx, 1);
+}
+
+/* Allocate a block of 2^'order' pages from the region, splitting a larger
+   block if need be. Returns ~0ULL if none is available. The lock must be
+   held. */
+static uint64_t contig_alloc_locked(contig_t *c, unsigned order) {
+  if (c->npages == 0 || order > c->max_order)
+    return ~0ULL;
+
+  unsigned k, idx = ~0U;
+  for (k = order; k <= c->max_order && idx == ~0U; ++k) {
+    unsigned first = CONTIG_BM_OFFSET(c->max_pages, k);
+    unsigned nbits = c->max_pages >> k;
+    for (unsigned i = 0; i < nbits; i += 32) {
+      uint32_t w = c->bitmap[(first+i)/32];
+      /* Orders with fewer than 32 blocks share a word with the next order,
+         so mask off their bits. */
+      if (nbits < 32)
+        w = (w >> ((first+i)%32)) & ((1U << nbits) - 1);
+      if (w) {
+        idx = i + __builtin_ctz(w);
+        break;
+      }
+    }
+  }
+  if (idx == ~0U)
+    return ~0ULL;
+  --k;
+
+  contig_set(c, k, idx, 0);
+  /* Split down to the requested order, freeing the upper halves. */
+  while (k > order) {
+    --k;
+    idx <<= 1;
+    contig_set(c, k, idx + 1, 1);
+  }
+
+  c->nfree -= 1U << order;
+  return c->base + ((uint64_t)idx << order) * get_page_size();
+}
+
+/* Allocate a block of 2^'order' pages from any of the regions for 'req'.
+   Returns ~0ULL if none has one. The lock must be held. */
+static uint64_t contig_zone_alloc_locked(int req, unsigned order) {
+  for (unsigned i = 0; i < num_contigs[req]; ++i) {
+    uint64_t val = contig_alloc_locked(&contigs[req][i], order);
+    if (val != ~0ULL)
+      return val;
+  }
+  return ~0ULL;
+}
+
+/* Returns nonzero if another contiguous region should be carved for 'req'.
+   The lock must be held. */
+static int want_contig_locked(int req) {
+  unsigned n = num_contigs[req];
+  if (n == MAX_CONTIG_REGIONS)
+    return 0;
+  return n == 0 ||
+    (uint64_t)n * contig_region_pages[req] < total_frames[req] / CONTIG_POOL_DIV;
+}
+
+/* Mark 'n' pages starting at 'page' as freshly allocated with one owner. */
+static void desc_alloc(uint64_t page, unsigned n, int flags) {
+  for (unsigned i = 0; i < n; ++i) {
+    page_t *pg = get_page(page + (uint64_t)i * get_page_size());
+    if (!pg)
+      return;
+    pg->refcount = 1;
+    pg->flags = flags;
+    pg->zone = page_req(page);
+  }
+}
+
+/* Mark 'n' pages starting at 'page' as free. */
+static void desc_free(uint64_t page, unsigned n) {
+  for (unsigned i = 0; i < n; ++i) {
+    page_t *pg = get_page(page + (uint64_t)i * get_page_size());
+    if (!pg)
+      return;
+    pg->refcount = 0;
+    pg->flags = 0;
+  }
+}
+
+/* Drop the caller's reference to 'page' before freeing it. Returns nonzero
+   if that was the last one, so the frame itself can be freed; a page still
+   shared by other mappings stays allocated. */
+static int put_last_ref(uint64_t page) {
+  page_t *pg = get_page(page);
+  if (!pg)
+    return 1;
+
+  uint16_t r;
+  do {
+    r = pg->refcount;
+    if (r <= 1)
+      return 1;
+  } while (!__sync_bool_compare_and_swap(&pg->refcount, r, r - 1));
+  return 0;
+}
+
+/* Return a page to either its contiguous region or its stack. The lock
+   must be held. */
+static void push_locked(uint64_t page) {
+  contig_t *c = contig_find(page);
+  if (c)
+    contig_free_locked(c, page, 0);
+  else
+    stack_push(&stacks[page_req(page)], page);
+}
+
+/* Take a frame from the top of the last nonempty free range for 'req'.
+   Returns ~0ULL if there is none. The lock must be held. */
+static uint64_t range_pop_locked(int req) {
+  while (num_ranges[req] > 0) {
+    range_t *r = &ranges[req][num_ranges[req]-1];
+    if (r->end > r->base) {
+      r->end -= get_page_size();
+      return r->end;
+    }
+    --num_ranges[req];
+  }
+  return ~0ULL;
+}
+
+/* Register the free frames in [base, end), which must all belong on the
+   same stack, and which must already be counted in total_frames. The lock
+   must be held. */
+static void add_range_locked(uint64_t base, uint64_t end) {
+  int req = page_req(base);
+
+  /* Carve contiguous regions out of the range while the stack wants more. */
+  if (base < end && want_contig_locked(req)) {
+    uint64_t sz = (uint64_t)contig_region_pages[req] * get_page_size();
+    uint64_t start = (base + sz - 1) & ~(sz - 1);
+    if (start >= base && start < end && end - start >= sz) {
+      contig_t *c = &contigs[req][num_contigs[req]];
+      c->base = start;
+      c->npages = c->max_pages = contig_region_pages[req];
+      c->max_order = contig_region_order[req];
+      c->nfree = c->max_pages;
+      contig_set(c, c->max_order, 0, 1);
+      ++num_contigs[req];
+
+      add_range_locked(base, start);
+      add_range_locked(start + sz, end);
+      return;
+    }
+  }
+
+  if (base >= end)
+    return;
+
+  if (num_ranges[req] == MAX_RANGES) {
+    /* No slots left, so fall back to pushing each frame individually. */
+    for (; base < end; base += get_page_size())
+      stack_push(&stacks[req], base);
+    return;
+  }
+
+  ranges[req][num_ranges[req]].base = base;
+  ranges[req][num_ranges[req]].end = end;
+  ++num_ranges[req];
+}
+
+/* Pop a page satisfying 'req' from the stacks or free ranges, falling back
+   to the contiguous regions when they run dry. The lock must be held. */
+static uint64_t pop_locked(int req) {
   uint64_t val = stack_pop(&stacks[req]);
+  if (val == ~0ULL)
+    val = range_pop_locked(req);
 
-  if (val == ~0ULL && req == PAGE_REQ_NONE)
+  if (val == ~0ULL && req == PAGE_REQ_NONE) {
     val = stack_pop(&stacks[PAGE_REQ_UNDER4GB]);
+    if (val == ~0ULL)
+      val = range_pop_locked(PAGE_REQ_UNDER4GB);
+  }
+  if (val == ~0ULL)
+    val = contig_zone_alloc_locked(req, 0);
+  if (val == ~0ULL && req == PAGE_REQ_NONE)
+    val = contig_zone_alloc_locked(PAGE_REQ_UNDER4GB, 0);
+  return val;
+}
+
+/* Return the current core's magazine for 'req'. Interrupts must be
+   disabled. */
+static magazine_t *get_magazine(int req) {
+  int id = get_processor_id();
+  if (id == -1) id = 0;
+  return &magazines[id][req];
+}
+
+/* Return the number of frames for 'req' parked in the per-core magazines.
+   They are read unlocked, so this may be slightly stale. */
+static uint64_t magazine_frames(int req) {
+  uint64_t n = 0;
+  for (int i = 0; i < MAX_CORES; ++i)
+    n += magazines[i][req].n;
+  return n;
+}
+
+/* Return the number of free frames for 'req', including those parked in
+   the per-core magazines so that they count towards the watermarks. The
+   lock must be held. */
+static uint64_t zone_free_locked(int req) {
+  uint64_t n = magazine_frames(req);
+  if (stacks[req].addr)
+    n += stacks[req].addr - stacks[req].base;
+  for (unsigned i = 0; i < num_ranges[req]; ++i)
+    n += (ranges[req][i].end - ranges[req][i].base) / get_page_size();
+  for (unsigned i = 0; i < num_contigs[req]; ++i)
+    n += contigs[req][i].nfree;
+  return n;
+}
+
+/* Returns nonzero if 'req' is below its low watermark. The lock must be
+   held. */
+static int below_low_locked(int req) {
+  return zone_free_locked(req) < wmark_low[req];
+}
+
+/* Run the shrinkers until 'req' is back above its high watermark and at
+   least 'min' pages have been freed, or until they run out. Returns the
+   number of pages freed. */
+static unsigned reclaim(int req, unsigned min) {
+  /* On 32-bit targets everything is below 4GB, so reclaim for that zone. */
+  if (req == PAGE_REQ_NONE && total_frames[req] == 0)
+    req = PAGE_REQ_UNDER4GB;
+
+  if (!__sync_bool_compare_and_swap(&reclaiming, 0, 1))
+    return 0;
+
+  unsigned freed = 0;
+  for (unsigned i = 0; i < num_shrinkers; ++i) {
+    spinlock_acquire(&lock);
+    uint64_t avail = zone_free_locked(req);
+    spinlock_release(&lock);
+
+    unsigned want = (avail < wmark_high[req]) ?
+      (unsigned)(wmark_high[req] - avail) : 0;
+    if (freed < min && want < min - freed)
+      want = min - freed;
+    if (want == 0)
+      break;
+
+    freed += shrinkers[i](want, req);
+  }
+
+  ++reclaims[req];
+  reclaimed[req] += freed;
+  reclaiming = 0;
+  return freed;
+}
+
+/* Top up an empty magazine with up to MAGAZINE_BATCH pages from the
+   stacks, taking the lock once. Returns nonzero if this left the stack
+   below its low watermark. */
+static int refill(magazine_t *m, int req) {
+  spinlock_acquire(&lock);
+  while (m->n < MAGAZINE_BATCH) {
+    uint64_t val = pop_locked(req);
+    if (val == ~0ULL)
+      break;
+    m->frames[m->n++] = val;
+  }
+  int low = below_low_locked(req);
+  spinlock_release(&lock);
+  return low;
+}
+
+/* Push MAGAZINE_BATCH pages from a full magazine back on to the stacks,
+   taking the lock once. */
+static void drain(magazine_t *m, int req) {
+  spinlock_acquire(&lock);
+  while (m->n > MAGAZINE_SZ - MAGAZINE_BATCH)
+    push_locked(m->frames[--m->n]);
+  spinlock_release(&lock);
+  ++m->drains;
+}
+
+/* Take a frame for 'req' from the zero pools, or return ~0ULL if they are
+   empty, in which case the zeroing thread is woken. */
+static uint64_t zero_pool_pop(int req) {
+  uint64_t val = ~0ULL;
+
+  spinlock_acquire(&zero_lock);
+  zero_pool_t *z = &zero_pools[req];
+  if (z->n > 0)
+    val = z->frames[--z->n];
+  else if (req == PAGE_REQ_NONE && zero_pools[PAGE_REQ_UNDER4GB].n > 0)
+    val = zero_pools[PAGE_REQ_UNDER4GB].frames[--zero_pools[PAGE_REQ_UNDER4GB].n];
+
+  if (val != ~0ULL)
+    ++z->hits;
+  else
+    ++z->misses;
+
+  int wake = z->n < ZERO_POOL_LOW && req != PAGE_REQ_UNDER1MB;
+  spinlock_release(&zero_lock);
+
+  if (wake && zero_thread)
+    thread_wake(zero_thread);
+  return val;
+}
+
+/* Top up the zero pool for 'req', zeroing one frame at a time and yielding
+   in between. The scheduler is plain round-robin, so this still competes
+   with other threads, but for no more than a page's worth of work per turn.
+   Stops early if memory runs short. */
+static void zero_pool_fill(int req) {
+  while (zero_pools[req].n < ZERO_POOL_SZ) {
+    /* Don't hoard frames when memory is short. */
+    spinlock_acquire(&lock);
+    int short_of_memory = zone_free_locked(req) < wmark_high[req];
+    spinlock_release(&lock);
+    if (short_of_memory)
+      return;
+
+    uint64_t p = alloc_page(req);
+    if (p == ~0ULL)
+      return;
+    zero_page(p);
+
+    spinlock_acquire(&zero_lock);
+    int full = zero_pools[req].n == ZERO_POOL_SZ;
+    if (!full)
+      zero_pools[req].frames[zero_pools[req].n++] = p;
+    spinlock_release(&zero_lock);
 
+    if (full) {
+      free_page(p);
+      return;
+    }
+    thread_yield();
+  }
+}
+
+static void zero_thread_fn(void *unused) {
+  while (1) {
+    zero_pool_fill(PAGE_REQ_UNDER4GB);
+    if (sizeof(void*) == 8)
+      zero_pool_fill(PAGE_REQ_NONE);
+    thread_sleep();
+  }
+}
+
+/* Give zeroed frames back from the zero pools. */
+static unsigned zero_pool_shrink(unsigned nr_pages, int req) {
+  uint64_t frames[ZERO_POOL_SZ];
+  unsigned n = 0;
+
+  spinlock_acquire(&zero_lock);
+  zero_pool_t *z = &zero_pools[req];
+  while (z->n > 0 && n < nr_pages)
+    frames[n++] = z->frames[--z->n];
+  spinlock_release(&zero_lock);
+
+  /* Push straight on to the stacks rather than into this core's magazine,
+     so any core can use them. */
+  for (unsigned i = 0; i < n; ++i)
+    desc_free(frames[i], 1);
+  spinlock_acquire(&lock);
+  for (unsigned i = 0; i < n; ++i)
+    push_locked(frames[i]);
   spinlock_release(&lock);
+  return n;
+}
+
+int register_shrinker(shrinker_fn_t fn) {
+  spinlock_acquire(&shrinker_lock);
+  int ret = -1;
+  if (num_shrinkers < MAX_SHRINKERS) {
+    shrinkers[num_shrinkers++] = fn;
+    ret = 0;
+  }
+  spinlock_release(&shrinker_lock);
+  return ret;
+}
+
+/* Allocate a page without reclaiming. '*low' is set nonzero if the stack
+   for 'req' had to be touched and is now below its low watermark. */
+static uint64_t alloc_page_noreclaim(int req, int *low) {
+  int ints = get_interrupt_state();
+  disable_interrupts();
+
+  magazine_t *m = get_magazine(req);
+  if (m->n == 0) {
+    ++m->misses;
+    *low = refill(m, req);
+  } else {
+    ++m->hits;
+  }
+
+  uint64_t val = (m->n > 0) ? m->frames[--m->n] : ~0ULL;
+
+  /* Pages for PAGE_REQ_NONE may come from the UNDER4GB stack, so check
+     that core's magazine before giving up. */
+  if (val == ~0ULL && req == PAGE_REQ_NONE) {
+    m = get_magazine(PAGE_REQ_UNDER4GB);
+    if (m->n > 0)
+      val = m->frames[--m->n];
+  }
+
+  set_interrupt_state(ints);
+  return val;
+}
+
+uint64_t alloc_page(int req) {
+  if (req & PAGE_REQ_ZEROED) {
+    req &= ~PAGE_REQ_ZEROED;
+    uint64_t val = zero_pool_pop(req & ~PAGE_REQ_NOWAIT);
+    if (val == ~0ULL) {
+      val = alloc_page(req);
+      if (val != ~0ULL)
+        zero_page(val);
+    }
+    return val;
+  }
+
+  int nowait = req & PAGE_REQ_NOWAIT;
+  req &= ~PAGE_REQ_NOWAIT;
+
+  int low = 0;
+  uint64_t val = alloc_page_noreclaim(req, &low);
+
+  /* Reclaim before the stack runs dry, or retry once if it already has. */
+  if (val == ~0ULL && !nowait) {
+    if (reclaim(req, 1) > 0)
+      val = alloc_page_noreclaim(req, &low);
+  } else if (low && !nowait) {
+    reclaim(req, 0);
+  }
+
+  if (val != ~0ULL)
+    desc_alloc(val, 1, 0);
   return val;
 }
 
+/* Returns nonzero if 'page' belongs to a contiguous region, in which case
+   it must be freed under the lock rather than through a magazine. */
+static int is_contig(uint64_t page) {
+  return contig_find(page) != NULL;
+}
+
 int free_page(uint64_t page) {
-  int req;
-  if (page < 0x100000)
-    req = PAGE_REQ_UNDER1MB;
-  else if (sizeof(void*) == 4 || page < 0x10000000UL)
-    req = PAGE_REQ_UNDER4GB;
-  else
-    req = PAGE_REQ_NONE;
+  if (!put_last_ref(page))
+    return 0;
+
+  int req = page_req(page);
+  desc_free(page, 1);
+
+  if (is_contig(page)) {
+    spinlock_acquire(&lock);
+    push_locked(page);
+    spinlock_release(&lock);
+    return 0;
+  }
+
+  int ints = get_interrupt_state();
+  disable_interrupts();
+
+  magazine_t *m = get_magazine(req);
+  if (m->n == MAGAZINE_SZ)
+    drain(m, req);
+  m->frames[m->n++] = page;
+
+  set_interrupt_state(ints);
+  return 0;
+}
+
+/* Allocate 'n' pages without reclaiming. '*low' is set nonzero if the
+   stack for 'req' had to be touched and is now below its low watermark. */
+static int alloc_pages_noreclaim(unsigned n, int req, uint64_t *pages,
+                                 int *low) {
+  int ints = get_interrupt_state();
+  disable_interrupts();
+
+  /* Take what we can from the magazine, then pop the remainder from the
+     stacks under a single lock acquisition. 'pages' is filled from the back:
+     the stacks hand out frames in descending order, so this tends to leave
+     physically contiguous runs in ascending order for the caller. */
+  magazine_t *m = get_magazine(req);
+  unsigned i = n;
+  while (i > 0 && m->n > 0)
+    pages[--i] = m->frames[--m->n];
+
+  if (i == 0) {
+    ++m->hits;
+  } else {
+    ++m->misses;
+    spinlock_acquire(&lock);
+    while (i > 0) {
+      uint64_t val = pop_locked(req);
+      if (val == ~0ULL)
+        break;
+      pages[--i] = val;
+    }
+
+    /* Out of memory - give back everything we took. */
+    if (i > 0)
+      for (unsigned j = i; j < n; ++j)
+        push_locked(pages[j]);
+    *low = below_low_locked(req);
+    spinlock_release(&lock);
+  }
+
+  set_interrupt_state(ints);
+  return (i == 0) ? 0 : -1;
+}
+
+int alloc_pages(unsigned n, int req, uint64_t *pages) {
+  if (req & PAGE_REQ_ZEROED) {
+    req &= ~PAGE_REQ_ZEROED;
+
+    /* Take what the zero pool has and zero the rest ourselves. */
+    unsigned i = n;
+    while (i > 0) {
+      uint64_t val = zero_pool_pop(req & ~PAGE_REQ_NOWAIT);
+      if (val == ~0ULL)
+        break;
+      pages[--i] = val;
+    }
+    if (alloc_pages(i, req, pages) == -1) {
+      free_pages(n - i, &pages[i]);
+      return -1;
+    }
+    for (unsigned j = 0; j < i; ++j)
+      zero_page(pages[j]);
+    return 0;
+  }
+
+  int nowait = req & PAGE_REQ_NOWAIT;
+  req &= ~PAGE_REQ_NOWAIT;
+
+  int low = 0;
+  int ret = alloc_pages_noreclaim(n, req, pages, &low);
+
+  /* Reclaim before the stack runs dry, or retry once if it already has. */
+  if (ret == -1 && !nowait) {
+    if (reclaim(req, n) > 0)
+      ret = alloc_pages_noreclaim(n, req, pages, &low);
+  } else if (low && !nowait) {
+    reclaim(req, 0);
+  }
+
+  if (ret == -1)
+    return -1;
+  for (unsigned j = 0; j < n; ++j)
+    desc_alloc(pages[j], 1, 0);
+  return 0;
+}
+
+int free_pages(unsigned n, uint64_t *pages) {
+  int ints = get_interrupt_state();
+  disable_interrupts();
+
+  /* Top up the magazines first, then push whatever is left on to the
+     stacks under a single lock acquisition. Shared pages only lose a
+     reference. */
+  int locked = 0;
+  for (unsigned i = 0; i < n; ++i) {
+    if (!put_last_ref(pages[i]))
+      continue;
+    desc_free(pages[i], 1);
 
+    magazine_t *m = get_magazine(page_req(pages[i]));
+    if (!locked && m->n < MAGAZINE_SZ && !is_contig(pages[i])) {
+      m->frames[m->n++] = pages[i];
+      continue;
+    }
+    if (!locked) {
+      spinlock_acquire(&lock);
+      locked = 1;
+    }
+    push_locked(pages[i]);
+  }
+  if (locked)
+    spinlock_release(&lock);
+
+  set_interrupt_state(ints);
+  return 0;
+}
+
+int pmm_add_range(uint64_t base, uint64_t len) {
+  uint64_t pgmask = get_page_size() - 1;
+  uint64_t end = (base + len) & ~pgmask;
+  base = (base + pgmask) & ~pgmask;
+
+  /* Split the range where it crosses from one stack's zone to the next. */
+  spinlock_acquire(&lock);
+  if (end > phys_end)
+    phys_end = end;
+  while (base < end) {
+    uint64_t limit = page_req_limit(base);
+    uint64_t e = (end < limit) ? end : limit;
+
+    int req = page_req(base);
+    total_frames[req] += (e - base) / get_page_size();
+    wmark_low[req] = (unsigned)(total_frames[req] / WMARK_LOW_DIV);
+    wmark_high[req] = (unsigned)(total_frames[req] / WMARK_HIGH_DIV);
+
+    add_range_locked(base, e);
+
+    base = e;
+  }
+  spinlock_release(&lock);
+  return 0;
+}
+
+uint64_t alloc_pages_contig(unsigned order, int req) {
+  int zeroed = req & PAGE_REQ_ZEROED;
+  int nowait = req & PAGE_REQ_NOWAIT;
+  req &= ~(PAGE_REQ_ZEROED|PAGE_REQ_NOWAIT);
+
+  uint64_t val = ~0ULL;
+  for (int attempt = 0; attempt < 2 && val == ~0ULL; ++attempt) {
+    /* Shrinkers may free pages back into the region, so reclaim and try
+       once more before failing. */
+    if (attempt > 0 && (nowait || reclaim(req, 1U << order) == 0))
+      break;
+
+    spinlock_acquire(&lock);
+    val = contig_zone_alloc_locked(req, order);
+    if (val == ~0ULL && req == PAGE_REQ_NONE)
+      val = contig_zone_alloc_locked(PAGE_REQ_UNDER4GB, order);
+    if (val != ~0ULL)
+      ++contig_allocs[order];
+    spinlock_release(&lock);
+  }
+
+  if (val != ~0ULL) {
+    desc_alloc(val, 1U << order, PAGE_DESC_CONTIG);
+    if (zeroed)
+      for (unsigned i = 0; i < (1U << order); ++i)
+        zero_page(val + (uint64_t)i * get_page_size());
+  }
+  return val;
+}
+
+int free_pages_contig(uint64_t base, unsigned order) {
+  contig_t *c = contig_find(base);
+  uint64_t sz = ((uint64_t)get_page_size()) << order;
+
+  if (!c || !contig_contains(c, base + sz - 1) ||
+      ((base - c->base) & (sz-1)) != 0)
+    return -1;
+
+  desc_free(base, 1U << order);
+
+  spinlock_acquire(&lock);
+  contig_free_locked(c, base, order);
+  ++contig_frees[order];
+  spinlock_release(&lock);
+  return 0;
+}
+
+int pmm_get_stats(pmm_stats_t *s) {
   spinlock_acquire(&lock);
-  stack_push(&stacks[req], page);
+  for (int req = 0; req < 3; ++req) {
+    s->total_frames[req] = total_frames[req];
+    s->free_frames[req] = zone_free_locked(req);
+    s->reclaims[req] = reclaims[req];
+  }
+  for (unsigned i = 0; i <= PAGE_CONTIG_MAX_ORDER; ++i) {
+    s->contig_allocs[i] = contig_allocs[i];
+    s->contig_frees[i] = contig_frees[i];
+  }
   spinlock_release(&lock);
 
+  /* The zeroed pools are read unlocked, so may be slightly stale. */
+  for (int req = 0; req < 3; ++req)
+    s->free_frames[req] += zero_pools[req].n;
+  return 0;
+}
+
+page_t *get_page(uint64_t p) {
+  uint64_t pfn = p / get_page_size();
+  if (pfn >= num_page_descs)
+    return NULL;
+  return &page_descs[pfn];
+}
+
+int page_ref(uint64_t p) {
+  page_t *pg = get_page(p);
+  if (!pg)
+    return -1;
+
+  /* An unknown refcount means the page predates the descriptor array, and
+     has exactly one owner - the one sharing it now. */
+  if (__sync_bool_compare_and_swap(&pg->refcount, 0, 2))
+    return 2;
+  return __sync_add_and_fetch(&pg->refcount, 1);
+}
+
+int page_unref(uint64_t p) {
+  page_t *pg = get_page(p);
+  if (!pg)
+    return -1;
+
+  uint16_t r;
+  do {
+    r = pg->refcount;
+    if (r == 0)
+      return -1;
+  } while (!__sync_bool_compare_and_swap(&pg->refcount, r, r - 1));
+  return r - 1;
+}
+
+int page_sole_owner(uint64_t p) {
+  page_t *pg = get_page(p);
+  return pg && __sync_bool_compare_and_swap(&pg->refcount, 1, 1);
+}
+
+/* Allocate, map and clear the page descriptor array. Frames allocated
+   before this point (including those backing the array itself) are left
+   with an unknown refcount. */
+static void init_page_descs() {
+  unsigned pgsz = get_page_size();
+  uint64_t n = phys_end / pgsz;
+  uint64_t max = (MMAP_PAGE_DESCS_END - MMAP_PAGE_DESCS) / sizeof(page_t);
+  if (n > max)
+    n = max;
+
+  uintptr_t sz = (uintptr_t)((n * sizeof(page_t) + pgsz - 1) & ~(pgsz - 1));
+  for (uintptr_t v = MMAP_PAGE_DESCS; v < MMAP_PAGE_DESCS + sz; v += pgsz) {
+    uint64_t p = alloc_page(PAGE_REQ_NONE);
+    if (p == ~0ULL || map(v, p, 1, PAGE_WRITE) == -1)
+      panic("Unable to allocate page descriptors!");
+  }
+  memset((uint8_t*)MMAP_PAGE_DESCS, 0, sz);
+
+  page_descs = (page_t*)MMAP_PAGE_DESCS;
+  num_page_descs = n;
+}
+
+static void inspect_pmm(const char *cmd, core_debug_state_t *states, int core) {
+  static const char *names[3] = {"none", "<1MB", "<4GB"};
+
+  for (int req = 0; req < 3; ++req) {
+    unsigned cached = 0, hits = 0, misses = 0, drains = 0, untouched = 0;
+    for (unsigned i = 0; i < num_ranges[req]; ++i)
+      untouched += (unsigned)((ranges[req][i].end - ranges[req][i].base) /
+                              get_page_size());
+    for (int i = 0; i < MAX_CORES; ++i) {
+      cached += magazines[i][req].n;
+      hits += magazines[i][req].hits;
+      misses += magazines[i][req].misses;
+      drains += magazines[i][req].drains;
+    }
+    unsigned total = hits + misses;
+    kprintf("%s: untouched %u, cached %u, hits %u, misses %u (hit rate %u%%), "
+            "drains %u\n", names[req], untouched, cached, hits, misses,
+            total ? (hits * 100) / total : 0, drains);
+  }
+
+  for (int req = 0; req < 3; ++req) {
+    zero_pool_t *z = &zero_pools[req];
+    unsigned total = z->hits + z->misses;
+    kprintf("%s zeroed: pool %u, hits %u, misses %u (hit rate %u%%)\n",
+            names[req], z->n, z->hits, z->misses,
+            total ? (z->hits * 100) / total : 0);
+  }
+
+  /* The debugger has stopped the world, so read without the lock. */
+  for (int req = 0; req < 3; ++req)
+    kprintf("%s: free %u (low %u, high %u), reclaims %u, reclaimed %u\n",
+            names[req], (unsigned)zone_free_locked(req), wmark_low[req],
+            wmark_high[req], reclaims[req], reclaimed[req]);
+}
+
+static int pmm_init() {
+  init_page_descs();
+  register_shrinker(&zero_pool_shrink);
+
+  register_debugger_handler("pmm", "Print physical memory manager statistics",
+                            &inspect_pmm);
+  return 0;
+}
+
+static const char *prereqs[] = {"debugger", "x86/free_memory",
+                                "hosted/free_memory", NULL};
+static init_fini_fn_t x run_on_startup = {
+  .name = "pmm",
+  .prerequisites = prereqs,
+  .fn = &pmm_init
+};
+
+static int pmm_zero_init() {
+  zero_thread = thread_spawn(&zero_thread_fn, NULL, /*auto_free=*/0);
+  /* Without the thread the pools are never refilled, and zeroed
+     allocations zero pages as they go. */
+  if (!zero_thread)
+    return -1;
   return 0;
 }
+
+static const char *zero_prereqs[] = {"pmm", "threading", NULL};
+static init_fini_fn_t y run_on_startup = {
+  .name = "pmm/zero",
+  .prerequisites = zero_prereqs,
+  .fn = &pmm_zero_init
+};
@@ -2,10 +2,25 @@
 #include "slab.h"
 #include "string.h"
 
+/* Lives at the end of each slab. Free objects are threaded into a list
+   through their first word, or, if the cache has a constructor, through an
+   array of links just below the footer so constructed state is left
+   alone. Objects at index 'fresh' and above have never been allocated, so
+   are neither on the list nor constructed yet; this saves touching every
+   object when the slab is created. */
 typedef struct slab_footer {
-  struct slab_footer *next;
+  struct slab_footer *next, *prev;
+  void *free;
+  unsigned in_use, fresh;
+  /* Offset of the first object from the start of the slab. */
+  unsigned color;
 } slab_footer_t;
 
+/* Slabs are coloured in steps of this many bytes, a cache line, so the
+   objects at the same index in different slabs fall in different cache
+   sets. */
+#define SLAB_COLOR_ALIGN 64
+
 #define SLAB_ADDR_MASK ~(SLAB_SIZE-1)
 #define FOOTER_FOR_PTR(x) (void*)(((uintptr_t) x & SLAB_ADDR_MASK) + SLAB_SIZE - sizeof(slab_footer_t))
 #define START_FOR_FOOTER(f) ((uintptr_t)f & SLAB_ADDR_MASK)
@@ -15,174 +30,481 @@ typedef struct slab_footer {
 static void destroy(slab_cache_t *c, slab_footer_t *f);
 /* Create a new slab, in the given cache. */
 static slab_footer_t *create(slab_cache_t *c);
-/* Mark a slab entry as used - obj is a pointer relative to the start of the slab. */
-static void mark_used(slab_cache_t *c, slab_footer_t *f, void *obj);
-/* Mark a slab entry as unused - obj is a pointer relative to the start of the slab. */
-static void mark_unused(slab_cache_t *c, slab_footer_t *f, void *obj);
-/* Predicate: are all the entries in the given slab unused? */
-static int all_unused(slab_cache_t *c, slab_footer_t *f);
-/* Return the address of an empty object in the given slab, or NULL if all full. */
-static void *find_empty_obj(slab_cache_t *c, slab_footer_t *f);
-
-int slab_cache_create(slab_cache_t *c, vmspace_t *vms, unsigned size, void *init) {
+/* Shrinker callback: destroy unused slabs across all caches that are not
+   busy. */
+static unsigned slab_shrinker(unsigned nr_pages, int req);
+/* Allocate an object straight from the slabs. c->lock must be held. Sets
+   '*fresh' if the object has never been handed out before, so needs
+   constructing. */
+static void *alloc_obj(slab_cache_t *c, int *fresh);
+/* Return an object straight to the slabs. c->lock must be held. */
+static void free_obj(slab_cache_t *c, void *obj);
+/* Return every object in 'm' to the slabs. c->lock must be held. */
+static void flush_magazine(slab_cache_t *c, slab_magazine_t *m);
+
+/* All live caches, so the shrinker can find them. */
+static slab_cache_t *caches = NULL;
+static spinlock_t caches_lock = SPINLOCK_RELEASED;
+
+int slab_cache_create(slab_cache_t *c, vmspace_t *vms, unsigned size,
+                      slab_ctor_fn_t ctor, slab_dtor_fn_t dtor) {
+  /* Free objects hold a freelist pointer, unless it is kept out of line,
+     so every object must be big enough and aligned enough for one. */
+  if (size < sizeof(void*))
+    size = sizeof(void*);
+  size = (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+  unsigned avail = SLAB_SIZE - sizeof(slab_footer_t);
+  unsigned stride = ctor ? size + sizeof(void*) : size;
+  if (stride > avail)
+    return -1;
+
   c->size = size;
-  c->init = init;
-  c->first = NULL;
-  c->empty = NULL;
+  c->objs_per_slab = avail / stride;
+  c->ctor = ctor;
+  c->dtor = dtor;
+  c->partial = c->full_slabs = c->empty_slabs = NULL;
+  c->nempty = 0;
+  c->max_empty = SLAB_DEFAULT_MAX_EMPTY;
   c->vms = vms;
+
+  /* Rotate the first object's offset through whatever slack is left at
+     the end of the slab. */
+  c->ncolors = (avail - c->objs_per_slab * stride) / SLAB_COLOR_ALIGN + 1;
+  c->next_color = 0;
+  c->nslabs = c->in_use = 0;
+  c->created = c->destroyed = 0;
   spinlock_init(&c->lock);
+
+  memset((uint8_t*)c->cpus, 0, sizeof(c->cpus));
+  c->full = c->empties = NULL;
+  c->nfull = 0;
+  c->mag_pages = NULL;
+  spinlock_init(&c->depot_lock);
+
+  spinlock_acquire(&caches_lock);
+  static int registered = 0;
+  if (!registered)
+    registered = register_shrinker(&slab_shrinker) == 0;
+  c->next = caches;
+  caches = c;
+  spinlock_release(&caches_lock);
   return 0;
 }
 
 int slab_cache_destroy(slab_cache_t *c) {
-  slab_footer_t *s = c->first;
-  while (s) {
-    slab_footer_t *s_ = s->next;
-    destroy(c, s);
-    s = s_;
+  /* The cache must no longer be in use, so every core's magazines can be
+     emptied from here. */
+  spinlock_acquire(&c->lock);
+  for (unsigned i = 0; i < MAX_CORES; ++i) {
+    if (c->cpus[i].loaded)
+      flush_magazine(c, c->cpus[i].loaded);
+    if (c->cpus[i].previous)
+      flush_magazine(c, c->cpus[i].previous);
+    c->cpus[i].loaded = c->cpus[i].previous = NULL;
+  }
+  for (slab_magazine_t *m = c->full; m; m = m->next)
+    flush_magazine(c, m);
+  c->full = c->empties = NULL;
+  c->nfull = 0;
+  spinlock_release(&c->lock);
+
+  while (c->mag_pages) {
+    void *next = *(void**)c->mag_pages;
+    vmspace_free(c->vms, get_page_size(), (uintptr_t)c->mag_pages,
+                 /*free_phys=*/1);
+    c->mag_pages = next;
+  }
+
+  slab_footer_t **lists[3] = {&c->partial, &c->full_slabs, &c->empty_slabs};
+  for (unsigned i = 0; i < 3; ++i) {
+    slab_footer_t *s = *lists[i];
+    while (s) {
+      slab_footer_t *s_ = s->next;
+      destroy(c, s);
+      s = s_;
+    }
+    *lists[i] = NULL;
   }
-  c->first = NULL;
+  c->nempty = 0;
+
+  spinlock_acquire(&caches_lock);
+  slab_cache_t **cp = &caches;
+  while (*cp && *cp != c)
+    cp = &(*cp)->next;
+  if (*cp)
+    *cp = c->next;
+  spinlock_release(&caches_lock);
   return 0;
 }
 
-void *slab_cache_alloc(slab_cache_t *c) {
-  spinlock_acquire(&c->lock);
+/* Return the current core's magazines for 'c'. Interrupts must be
+   disabled. */
+static slab_cpu_t *get_cpu(slab_cache_t *c) {
+  int id = get_processor_id();
+  if (id == -1) id = 0;
+  return &c->cpus[id];
+}
 
-  void *obj;
-  if (c->empty) {
+static void swap_magazines(slab_cpu_t *cpu) {
+  slab_magazine_t *m = cpu->loaded;
+  cpu->loaded = cpu->previous;
+  cpu->previous = m;
+}
 
-    obj = c->empty;
-    slab_footer_t *f = FOOTER_FOR_PTR(obj);
-    mark_used(c, f, obj);
+/* Carve a fresh page into empty magazines and add them to the depot.
+   Returns -1 if there is no memory for it. */
+static int new_magazines(slab_cache_t *c) {
+  unsigned pgsz = get_page_size();
+  uintptr_t page = vmspace_alloc(c->vms, pgsz, /*alloc_phys=*/PAGE_WRITE);
+  if (page == 0)
+    return -1;
+
+  /* The first magazine's worth of the page links it into mag_pages. */
+  slab_magazine_t *m = (slab_magazine_t*)page;
+  spinlock_acquire(&c->depot_lock);
+  *(void**)page = c->mag_pages;
+  c->mag_pages = (void*)page;
+  for (++m; (uintptr_t)(m+1) <= page + pgsz; ++m) {
+    m->n = 0;
+    m->next = c->empties;
+    c->empties = m;
+  }
+  spinlock_release(&c->depot_lock);
+  return 0;
+}
 
-    while (f) {
-      c->empty = find_empty_obj(c, f);
-      if (c->empty) break;
-      f = f->next;
+void *slab_cache_alloc(slab_cache_t *c) {
+  int ints = get_interrupt_state();
+  disable_interrupts();
+
+  slab_cpu_t *cpu = get_cpu(c);
+  if ((!cpu->loaded || cpu->loaded->n == 0) &&
+      cpu->previous && cpu->previous->n > 0)
+    swap_magazines(cpu);
+
+  if (!cpu->loaded || cpu->loaded->n == 0) {
+    /* Both are empty; swap one for a full magazine from the depot. */
+    spinlock_acquire(&c->depot_lock);
+    if (c->full) {
+      slab_magazine_t *m = c->full;
+      c->full = m->next;
+      --c->nfull;
+      if (cpu->previous) {
+        cpu->previous->next = c->empties;
+        c->empties = cpu->previous;
+      }
+      cpu->previous = cpu->loaded;
+      cpu->loaded = m;
     }
+    spinlock_release(&c->depot_lock);
+  }
 
+  void *obj = NULL;
+  int fresh = 0;
+  if (cpu->loaded && cpu->loaded->n > 0) {
+    obj = cpu->loaded->objs[--cpu->loaded->n];
+    ++cpu->hits;
   } else {
+    ++cpu->misses;
+  }
+  set_interrupt_state(ints);
+
+  if (!obj) {
+    spinlock_acquire(&c->lock);
+    obj = alloc_obj(c, &fresh);
+    spinlock_release(&c->lock);
+    if (!obj)
+      return NULL;
+  }
+
+  if (fresh && c->ctor)
+    c->ctor(obj);
+  return obj;
+}
 
-    /* No empty pointer - must create a new slab. */
-    slab_footer_t *f = c->first;
-    c->first = create(c);
-    c->first->next = f;
-    
-    obj = (void*)START_FOR_FOOTER(c->first);
-    mark_used(c, c->first, obj);
+void slab_cache_free(slab_cache_t *c, void *obj) {
+  for (int tries = 0; tries < 2; ++tries) {
+    int ints = get_interrupt_state();
+    disable_interrupts();
+
+    slab_cpu_t *cpu = get_cpu(c);
+    if ((!cpu->loaded || cpu->loaded->n == SLAB_MAGAZINE_SZ) &&
+        cpu->previous && cpu->previous->n == 0)
+      swap_magazines(cpu);
+
+    if (!cpu->loaded || cpu->loaded->n == SLAB_MAGAZINE_SZ) {
+      /* Both are full; swap one for an empty magazine from the depot. */
+      spinlock_acquire(&c->depot_lock);
+      if (c->empties) {
+        slab_magazine_t *m = c->empties;
+        c->empties = m->next;
+        if (cpu->previous) {
+          cpu->previous->next = c->full;
+          c->full = cpu->previous;
+          ++c->nfull;
+        }
+        cpu->previous = cpu->loaded;
+        cpu->loaded = m;
+      }
+      spinlock_release(&c->depot_lock);
+    }
 
-    c->empty = find_empty_obj(c, c->first);
+    if (cpu->loaded && cpu->loaded->n < SLAB_MAGAZINE_SZ) {
+      cpu->loaded->objs[cpu->loaded->n++] = obj;
+      set_interrupt_state(ints);
+      return;
+    }
+    set_interrupt_state(ints);
 
+    /* The depot has run out of empty magazines. Make some more and try
+       again, or failing that free straight to the slabs. */
+    if (tries > 0 || new_magazines(c) == -1)
+      break;
   }
-  if (c->init)
-    memcpy(obj, c->init, c->size);
 
+  spinlock_acquire(&c->lock);
+  free_obj(c, obj);
   spinlock_release(&c->lock);
+}
+
+/* Return where the freelist link for 'obj' is kept. */
+static void **free_link(slab_cache_t *c, slab_footer_t *f, void *obj) {
+  if (!c->ctor)
+    return (void**)obj;
+  unsigned idx = ((uintptr_t)obj - START_FOR_FOOTER(f) - f->color) / c->size;
+  return (void**)f - c->objs_per_slab + idx;
+}
+
+/* Add slab 'f' to the head of the list at 'head'. */
+static void list_push(slab_footer_t **head, slab_footer_t *f) {
+  f->prev = NULL;
+  f->next = *head;
+  if (*head)
+    (*head)->prev = f;
+  *head = f;
+}
+
+/* Remove slab 'f' from the list at 'head'. */
+static void list_remove(slab_footer_t **head, slab_footer_t *f) {
+  if (f->prev)
+    f->prev->next = f->next;
+  else
+    *head = f->next;
+  if (f->next)
+    f->next->prev = f->prev;
+}
+
+static void *alloc_obj(slab_cache_t *c, int *fresh) {
+  /* Prefer partially used slabs, then empty ones, and only create a new
+     slab if there are neither. */
+  slab_footer_t *f = c->partial;
+  if (!f && c->empty_slabs) {
+    f = c->empty_slabs;
+    list_remove(&c->empty_slabs, f);
+    --c->nempty;
+    list_push(&c->partial, f);
+  }
+  if (!f) {
+    f = create(c);
+    if (!f)
+      return NULL;
+    list_push(&c->partial, f);
+  }
+
+  void *obj;
+  if (f->free) {
+    obj = f->free;
+    f->free = *free_link(c, f, obj);
+    *fresh = 0;
+  } else {
+    obj = (void*)(START_FOR_FOOTER(f) + f->color + f->fresh++ * c->size);
+    *fresh = 1;
+  }
+
+  if (++f->in_use == c->objs_per_slab) {
+    list_remove(&c->partial, f);
+    list_push(&c->full_slabs, f);
+  }
+  ++c->in_use;
   return obj;
 }
 
-void slab_cache_free(slab_cache_t *c, void *obj) {
-  spinlock_acquire(&c->lock);
+static void free_obj(slab_cache_t *c, void *obj) {
   slab_footer_t *f = FOOTER_FOR_PTR(obj);
 
-  mark_unused(c, f, obj);
-  if (!c->empty || c->empty > obj)
-    c->empty = obj;
+  *free_link(c, f, obj) = f->free;
+  f->free = obj;
+  --c->in_use;
 
-  if (!f->next && all_unused(c, f)) {
-    slab_footer_t *f2 = c->first;
-    while (f2->next != f)
-      f2 = f2->next;
+  if (f->in_use-- == c->objs_per_slab) {
+    list_remove(&c->full_slabs, f);
+    list_push(&c->partial, f);
+  }
 
-    f2->next = f->next;
-    destroy(c, f);
+  if (f->in_use == 0) {
+    list_remove(&c->partial, f);
+    /* Keep some empty slabs around, so a cache hovering around a slab
+       boundary doesn't create and destroy one on every call. */
+    if (c->nempty < c->max_empty) {
+      list_push(&c->empty_slabs, f);
+      ++c->nempty;
+    } else {
+      destroy(c, f);
+    }
   }
+}
 
-  spinlock_release(&c->lock);
+static void flush_magazine(slab_cache_t *c, slab_magazine_t *m) {
+  while (m->n > 0)
+    free_obj(c, m->objs[--m->n]);
 }
 
 static void destroy(slab_cache_t *c, slab_footer_t *f) {
+  /* Only objects that were ever handed out have been constructed. */
+  if (c->dtor)
+    for (unsigned i = 0; i < f->fresh; ++i)
+      c->dtor((void*)(START_FOR_FOOTER(f) + f->color + i * c->size));
   vmspace_free(c->vms, SLAB_SIZE, START_FOR_FOOTER(f), /*free_phys=*/1);
+  --c->nslabs;
+  ++c->destroyed;
 }
 
-/* Return the number of entries in a bitmap for an object of 'obj_sz'. */
-static inline unsigned bitmap_num(int obj_sz) {
-  unsigned avail = SLAB_SIZE - sizeof(slab_footer_t);
-  return avail / obj_sz;
-}
-
-/* Return the size in bytes of a bitmap for an object of 'obj_sz'. */
-static inline unsigned bitmap_sz(int obj_sz) {
-  return bitmap_num(obj_sz) / 8 + 1;
-}
+void slab_cache_get_stats(slab_cache_t *c, slab_cache_stats_t *s) {
+  /* The per-core magazines are read unlocked, so may be slightly stale. */
+  s->cached = s->hits = s->misses = 0;
+  for (unsigned i = 0; i < MAX_CORES; ++i) {
+    slab_cpu_t *cpu = &c->cpus[i];
+    if (cpu->loaded)
+      s->cached += cpu->loaded->n;
+    if (cpu->previous)
+      s->cached += cpu->previous->n;
+    s->hits += cpu->hits;
+    s->misses += cpu->misses;
+  }
+  spinlock_acquire(&c->depot_lock);
+  s->cached += c->nfull * SLAB_MAGAZINE_SZ;
+  spinlock_release(&c->depot_lock);
 
-/* Return the bitmap entry index that represents 'obj'. */
-static inline unsigned bitmap_idx(slab_footer_t *f, void *obj, int obj_sz) {
-  return ( (uintptr_t)obj - START_FOR_FOOTER(f) ) / obj_sz;
+  spinlock_acquire(&c->lock);
+  s->size = c->size;
+  s->slabs = c->nslabs;
+  s->empty = c->nempty;
+  s->created = c->created;
+  s->destroyed = c->destroyed;
+  s->objs_per_slab = c->objs_per_slab;
+  s->in_use = c->in_use > s->cached ? c->in_use - s->cached : 0;
+  spinlock_release(&c->lock);
 }
 
 static slab_footer_t *create(slab_cache_t *c) {
   uintptr_t addr = vmspace_alloc(c->vms, SLAB_SIZE, /*alloc_phys=*/PAGE_WRITE);
+  if (addr == 0)
+    return NULL;
 
   slab_footer_t *f = FOOTER_FOR_PTR(addr);
-  f->next = NULL;
-  
-  /* Initialise the used/free bitmap. */
-  uintptr_t bm = (uintptr_t)f - bitmap_sz(c->size);
-  memset((uint8_t*)bm, 0, bitmap_sz(c->size));
+  f->free = NULL;
+  f->in_use = f->fresh = 0;
+  f->color = c->next_color * SLAB_COLOR_ALIGN;
+  if (++c->next_color >= c->ncolors)
+    c->next_color = 0;
+  ++c->nslabs;
+  ++c->created;
 
   return f;
 }
 
-static void mark_used(slab_cache_t *c, slab_footer_t *f, void *obj) {
-  unsigned idx = bitmap_idx(f, obj, c->size);
-  unsigned sz = bitmap_sz(c->size);
-
-  unsigned byte = idx >> 3;
-  unsigned bit = idx & 7;
-  uint8_t *ptr = (uint8_t*)f - sz + byte;
-  *ptr |= 1 << bit;
+/* Destroy empty slabs in 'c' until at most 'keep' remain. c->lock must be
+   held. */
+static void trim_empty(slab_cache_t *c, unsigned keep) {
+  while (c->nempty > keep) {
+    slab_footer_t *f = c->empty_slabs;
+    list_remove(&c->empty_slabs, f);
+    --c->nempty;
+    destroy(c, f);
+  }
 }
 
-static void mark_unused(slab_cache_t *c, slab_footer_t *f, void *obj) {
-  unsigned idx = bitmap_idx(f, obj, c->size);
-  unsigned sz = bitmap_sz(c->size);
+/* Flush the depot's full magazines and destroy every empty slab in 'c',
+   returning the number of pages released. c->depot_lock and c->lock must
+   be held; c->depot_lock is released. */
+static unsigned shrink_locked(slab_cache_t *c) {
+  unsigned nslabs = c->nslabs;
+
+  /* Objects in the depot's full magazines pin their slabs; give them back
+     first. The per-core magazines belong to their cores. */
+  while (c->full) {
+    slab_magazine_t *m = c->full;
+    c->full = m->next;
+    flush_magazine(c, m);
+    m->next = c->empties;
+    c->empties = m;
+  }
+  c->nfull = 0;
+  spinlock_release(&c->depot_lock);
 
-  unsigned byte = idx >> 3;
-  unsigned bit = idx & 7;
-  uint8_t *ptr = (uint8_t*)f - sz + byte;
-  *ptr &= ~(1 << bit);
+  trim_empty(c, 0);
+  return (nslabs - c->nslabs) * (SLAB_SIZE / get_page_size());
 }
 
-static int all_unused(slab_cache_t *c, slab_footer_t *f) {
-  unsigned sz = bitmap_sz(c->size);
-  uint8_t *p = (uint8_t*)f - sz;
+void slab_cache_set_max_empty(slab_cache_t *c, unsigned n) {
+  spinlock_acquire(&c->lock);
+  c->max_empty = n;
+  trim_empty(c, n);
+  spinlock_release(&c->lock);
+}
 
-  /* FIXME: Use something fast like memcmp? */
-  for (unsigned i = 0; i < sz; ++i)
-    if (*p++ != 0) return 0;
-  return 1;
+unsigned slab_cache_shrink(slab_cache_t *c) {
+  spinlock_acquire(&c->depot_lock);
+  spinlock_acquire(&c->lock);
+  unsigned n = shrink_locked(c);
+  spinlock_release(&c->lock);
+  return n;
 }
 
-static int lsb_clear(uint8_t byte) {
-  int i = 0;
-  while ((byte & 1) == 1) {
-    ++i;
-    byte >>= 1;
+unsigned slab_cache_reap() {
+  unsigned n = 0;
+  spinlock_acquire(&caches_lock);
+  for (slab_cache_t *c = caches; c; c = c->next) {
+    /* Freeing slabs can allocate pages, and so run the shrinker, which
+       needs caches_lock; don't hold it across the shrink. */
+    spinlock_release(&caches_lock);
+    n += slab_cache_shrink(c);
+    spinlock_acquire(&caches_lock);
   }
-  return i;
+  spinlock_release(&caches_lock);
+  return n;
 }
 
-static void *find_empty_obj(slab_cache_t *c, slab_footer_t *f) {
-  unsigned sz = bitmap_sz(c->size);
-  uint8_t *p = (uint8_t*)f - sz;
-
-  for (unsigned i = 0; i < sz; ++i) {
-    if (*p != 0xFF) {
-      unsigned idx = i * 8 + lsb_clear(*p);
-      return (idx >= bitmap_num(c->size)) ? NULL : (void*)(START_FOR_FOOTER(f) + c->size*idx);
-    }
-    ++p;
+/* As slab_cache_shrink, but gives up if 'c' or its vmspace is busy, as the
+   allocation that triggered reclaim may be the one holding them. */
+static unsigned try_shrink(slab_cache_t *c) {
+  if (!spinlock_try_acquire(&c->depot_lock))
+    return 0;
+  if (!spinlock_try_acquire(&c->lock)) {
+    spinlock_release(&c->depot_lock);
+    return 0;
+  }
+  if (!spinlock_try_acquire(&c->vms->lock)) {
+    spinlock_release(&c->lock);
+    spinlock_release(&c->depot_lock);
+    return 0;
   }
-  return NULL;
+  spinlock_release(&c->vms->lock);
+
+  unsigned n = shrink_locked(c);
+  spinlock_release(&c->lock);
+  return n;
+}
+
+static unsigned slab_shrinker(unsigned nr_pages, int req) {
+  /* Reclaim can be entered from any allocation, so this core may already
+     hold caches_lock; give up rather than wait for it, as try_shrink does
+     for each cache. */
+  if (!spinlock_try_acquire(&caches_lock))
+    return 0;
+  unsigned n = 0;
+  for (slab_cache_t *c = caches; c && n < nr_pages; c = c->next)
+    n += try_shrink(c);
+  spinlock_release(&caches_lock);
+  return n;
 }
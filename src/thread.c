@@ -42,25 +42,28 @@ static void inspect_threads(const char *cmd, core_debug_state_t *states, int cor
   }
 }
 
-static uintptr_t alloc_stack_and_tls() {
-  unsigned pagesz = get_page_size();
-
-  uintptr_t addr = vmspace_alloc(&kernel_vmspace, THREAD_STACK_SZ, 0);
-
-  for (unsigned i = 0; i < THREAD_STACK_SZ; i += pagesz)
-    map(addr+i, alloc_page(PAGE_REQ_NONE), 1, PAGE_WRITE);
+/* Constructor for thread_cache. Everything except the jmp_buf
+   starts zeroed; thread_destroy puts a thread back this way before freeing
+   it, so thread_spawn only has to set what differs per thread. */
+static void thread_ctor(void *obj) {
+  thread_t *t = (thread_t*)obj;
+  t->id = 0;
+  t->prev = t->next = NULL;
+  t->scheduler_next = NULL;
+  t->semaphore_next = NULL;
+  t->stack = 0;
+  t->request_kill = 0;
+  t->state = 0;
+  t->priority = 0;
+  t->auto_free = 0;
+}
 
-  return addr;
+static uintptr_t alloc_stack_and_tls() {
+  return vmspace_alloc(&kernel_vmspace, THREAD_STACK_SZ, /*alloc_phys=*/PAGE_WRITE);
 }
 
 static void free_stack_and_tls(uintptr_t stack) {
-  unsigned pagesz = get_page_size();
-
-  unsigned flags;
-  for (unsigned i = 0; i < THREAD_STACK_SZ; i += pagesz) {
-    free_page(get_mapping(stack+i, &flags));
-    unmap(stack+i, 1);
-  }
+  vmspace_free(&kernel_vmspace, THREAD_STACK_SZ, stack, /*free_phys=*/1);
 }
 
 static void yield() {
@@ -110,9 +113,15 @@ thread_t *thread_current() {
 
 thread_t *thread_spawn(void (*fn)(void*), void *p, uint8_t auto_free) {
   thread_t *t = (thread_t*)slab_cache_alloc(&thread_cache);
+  if (!t)
+    return NULL;
 
   t->auto_free = auto_free;
   t->stack = alloc_stack_and_tls();
+  if (!t->stack) {
+    slab_cache_free(&thread_cache, (void*)t);
+    return NULL;
+  }
  
   spinlock_acquire(&thread_list_lock);
   t->next = thread_list_head;
@@ -150,6 +159,7 @@ void thread_destroy(thread_t *t) {
   spinlock_release(&thread_list_lock);
 
   free_stack_and_tls(t->stack);
+  thread_ctor(t);
   slab_cache_free(&thread_cache, (void*)t);
 }  
 
@@ -187,19 +197,8 @@ void thread_kill(thread_t *t) {
 }
 
 static int threading_init() {
-  static thread_t dummy_t = {
-    .id = 0,
-    .prev = NULL, .next = NULL,
-    .scheduler_next = NULL,
-    .semaphore_next = NULL,
-    .stack = 0,
-    .request_kill = 0,
-    .state = 0,
-    .priority = 0,
-    .auto_free = 0
-  };
-
-  int r = slab_cache_create(&thread_cache, &kernel_vmspace, sizeof(thread_t), (void*)&dummy_t);
+  int r = slab_cache_create(&thread_cache, &kernel_vmspace, sizeof(thread_t),
+                            &thread_ctor, NULL);
   assert(r == 0 && "slab_cache_create failed!");
 
   thread_t *t = (thread_t*)slab_cache_alloc(&thread_cache);
@@ -1,154 +1,792 @@
 #include "hal.h"
 #include "math.h"
+#include "string.h"
 #include "vmspace.h"
 
 #define BUDDY(x) (x ^ 1)
 
-static void *alloc(unsigned sz, void *p) {
-  uintptr_t *x = (uintptr_t*)p;
-  uintptr_t ret = *x;
+/* Maximum number of pages to allocate, free or map in one batch. */
+#define PAGE_BATCH 32
 
-  *x += get_page_size();
-  map(ret, alloc_page(PAGE_REQ_NONE), 1, PAGE_WRITE);
-
-  return (void*) ret;
-}
 static void free(void *ptr, void *p) {
   unsigned flags;
   free_page(get_mapping((uintptr_t)ptr, &flags));
   unmap((uintptr_t)ptr, 1);
 }
 
-int vmspace_init(vmspace_t *vms, uintptr_t addr, uintptr_t sz) {
+/* Map the 'n' pages in 'pages' contiguously from 'v', merging physically
+   contiguous runs into a single map() call. Returns the number of pages
+   mapped, which is less than 'n' if map() failed. */
+static unsigned map_pages(uintptr_t v, uint64_t *pages, unsigned n,
+                          unsigned flags) {
+  unsigned pgsz = get_page_size();
+  unsigned i = 0;
+  while (i < n) {
+    unsigned run = 1;
+    while (i+run < n && pages[i+run] == pages[i] + run*pgsz)
+      ++run;
+
+    if (map(v + i*pgsz, pages[i], run, flags) == -1) {
+      /* map() may have got part way through the run. */
+      while (run > 0 && is_mapped(v + i*pgsz))
+        ++i, --run;
+      return i;
+    }
+    i += run;
+  }
+  return n;
+}
+
+/* Return the number of pages to handle in one batch at offset 'i' of an
+   'sz' byte region starting at 'addr'. Batches never straddle a large page
+   boundary. */
+static unsigned batch_size(uintptr_t addr, unsigned i, unsigned sz) {
+  unsigned pgsz = get_page_size();
+  unsigned lpsz = get_large_page_size();
+
+  unsigned n = (sz - i + pgsz - 1) / pgsz;
+  if (n > PAGE_BATCH) n = PAGE_BATCH;
+  if (lpsz) {
+    unsigned to_boundary = (lpsz - ((addr + i) & (lpsz-1))) / pgsz;
+    if (n > to_boundary) n = to_boundary;
+  }
+  return n;
+}
+
+/* Returns nonzero if a whole large page fits at offset 'i' of an 'sz' byte
+   region starting at 'addr'. */
+static int large_page_fits(uintptr_t addr, unsigned i, unsigned sz) {
+  unsigned lpsz = get_large_page_size();
+  return lpsz && sz - i >= lpsz && ((addr + i) & (lpsz-1)) == 0 &&
+    lpsz / get_page_size() <= (1U << PAGE_CONTIG_MAX_ORDER);
+}
+
+/* Try to back the large page at 'v' with physically contiguous memory.
+   Returns nonzero on success. */
+static int map_large(uintptr_t v, int req, unsigned flags) {
+  unsigned pgsz = get_page_size();
+  unsigned order = log2_roundup(get_large_page_size() / pgsz);
+
+  /* This is opportunistic, so don't reclaim memory for it. */
+  uint64_t p = alloc_pages_contig(order, req|PAGE_REQ_NOWAIT);
+  if (p == ~0ULL)
+    return 0;
+
+  if (map(v, p, 1U << order, flags|PAGE_LARGE) == -1) {
+    for (unsigned i = 0; i < (1U << order); ++i)
+      if (is_mapped(v + i*pgsz))
+        unmap(v + i*pgsz, 1);
+    free_pages_contig(p, order);
+    return 0;
+  }
+  return 1;
+}
+
+/* Unmap and free whichever of the pages in the 'sz' bytes at 'addr' have
+   been faulted in. */
+static void unmap_and_free_lazy(uintptr_t addr, unsigned sz) {
+  unsigned pgsz = get_page_size();
+  uint64_t pages[PAGE_BATCH];
+  unsigned n = 0;
+  for (unsigned i = 0; i < sz; i += pgsz) {
+    uint64_t p = get_mapping(addr + i, NULL);
+    if (p == ~0ULL)
+      continue;
+    unmap(addr + i, 1);
+    pages[n++] = p;
+    if (n == PAGE_BATCH) {
+      free_pages(n, pages);
+      n = 0;
+    }
+  }
+  if (n)
+    free_pages(n, pages);
+}
+
+/* Unmap the 'sz' bytes at 'addr' and free the pages backing them, a batch
+   at a time. */
+static void unmap_and_free(uintptr_t addr, unsigned sz) {
+  unsigned pgsz = get_page_size();
+  uint64_t pages[PAGE_BATCH];
+  for (unsigned i = 0; i < sz; ) {
+    if (large_page_fits(addr, i, sz)) {
+      unsigned flags = 0;
+      uint64_t p = get_mapping(addr + i, &flags);
+      if (p != ~0ULL && (flags & PAGE_LARGE)) {
+        unsigned order = log2_roundup(get_large_page_size() / pgsz);
+        unmap(addr + i, 1U << order);
+        free_pages_contig(p, order);
+        i += get_large_page_size();
+        continue;
+      }
+    }
+
+    unsigned n = batch_size(addr, i, sz);
+    for (unsigned j = 0; j < n; ++j) {
+      pages[j] = get_mapping(addr + i + j*pgsz, NULL);
+      if (pages[j] == ~0ULL)
+        panic("vmspace_free asked to free_phys but mapping did not exist!");
+    }
+    unmap(addr + i, n);
+    free_pages(n, pages);
+    i += n*pgsz;
+  }
+}
+
+/* Map the pages holding the 'sz' bytes at 'ptr', if they have not been
+   touched before, and return 'ptr'. */
+static void *touch(void *ptr, unsigned sz) {
+  uintptr_t mask = ~(uintptr_t)(get_page_size()-1);
+  uintptr_t page = (uintptr_t)ptr & mask;
+  for (; page <= (((uintptr_t)ptr + sz - 1) & mask); page += get_page_size()) {
+    if (is_mapped(page))
+      continue;
+    uint64_t p = alloc_page(PAGE_REQ_NONE|PAGE_REQ_ZEROED);
+    if (p == ~0ULL || map(page, p, 1, PAGE_WRITE) == -1)
+      panic("vmspace: out of memory for free list links!");
+  }
+  return ptr;
+}
+
+/* Return the index of the first block of 'order' that overlaps the
+   vmspace. */
+static unsigned first_block(vmspace_t *vms, unsigned order) {
+  return vms->start >> (order + MIN_BUDDY_SZ_LOG2);
+}
+
+/* Returns nonzero if block 'idx' of 'order' overlaps the vmspace, and so
+   has a free list link. */
+static int has_link(vmspace_t *vms, unsigned order, unsigned idx) {
+  uintptr_t last = vms->start + (vms->size - 1);
+  return idx >= first_block(vms, order) &&
+    idx <= (last >> (order + MIN_BUDDY_SZ_LOG2));
+}
+
+/* Return the free list link for block 'idx' of 'order', mapping the page
+   holding it if it has not been touched before. */
+static vmspace_link_t *link(vmspace_t *vms, unsigned order, unsigned idx) {
+  return touch(&vms->links[order][idx - first_block(vms, order)],
+               sizeof(vmspace_link_t));
+}
+
+/* Mark block 'idx' of 'order' free and add it to the tail of its free
+   list. */
+static void insert_free(vmspace_t *vms, unsigned order, unsigned idx) {
+  ++vms->nfree[order];
+
+  vmspace_link_t *l = link(vms, order, idx);
+  l->is_free = 1;
+  unsigned head = vms->free_heads[order];
+  if (head == VMSPACE_NIL) {
+    l->next = l->prev = idx;
+    vms->free_heads[order] = idx;
+    return;
+  }
+
+  vmspace_link_t *h = link(vms, order, head);
+  l->next = head;
+  l->prev = h->prev;
+  link(vms, order, h->prev)->next = idx;
+  h->prev = idx;
+}
+
+/* As insert_free(), but add the block to the head of the list, so the
+   most recently freed address space is reused first. */
+static void push_free(vmspace_t *vms, unsigned order, unsigned idx) {
+  insert_free(vms, order, idx);
+  vms->free_heads[order] = idx;
+}
+
+/* Take block 'idx' of 'order' off its free list and mark it allocated. */
+static void remove_free(vmspace_t *vms, unsigned order, unsigned idx) {
+  --vms->nfree[order];
+
+  vmspace_link_t *l = link(vms, order, idx);
+  l->is_free = 0;
+  if (l->next == idx) {
+    vms->free_heads[order] = VMSPACE_NIL;
+    return;
+  }
+
+  link(vms, order, l->prev)->next = l->next;
+  link(vms, order, l->next)->prev = l->prev;
+  if (vms->free_heads[order] == idx)
+    vms->free_heads[order] = l->next;
+}
+
+static unsigned log2_rounddown(unsigned n) {
+  return 31 - __builtin_clz(n);
+}
+
+/* Return the statistics order for an extent of 'npages' pages. */
+static unsigned stat_order(unsigned log_npages) {
+  return log_npages < VMSPACE_NUM_ORDERS ? log_npages : VMSPACE_NUM_ORDERS-1;
+}
+
+/* Return the boundary tag for page 'pg' of an extent vmspace, mapping it
+   if it has not been touched before. */
+static vmspace_tag_t *tag(vmspace_t *vms, unsigned pg) {
+  return touch(&vms->tags[pg], sizeof(vmspace_tag_t));
+}
+
+/* Write the boundary tags for the 'n' page extent starting at page 'pg'. */
+static void set_tags(vmspace_t *vms, unsigned pg, unsigned n, int is_free) {
+  tag(vms, pg)->tag = (n << 1) | is_free;
+  tag(vms, pg + n - 1)->tag = (n << 1) | is_free;
+}
+
+/* Mark the 'n' page extent at page 'pg' free and add it to the head of its
+   free list. */
+static void insert_extent(vmspace_t *vms, unsigned pg, unsigned n) {
+  unsigned list = log2_rounddown(n);
+  set_tags(vms, pg, n, 1);
+  ++vms->nfree[stat_order(list)];
+
+  vmspace_tag_t *t = tag(vms, pg);
+  unsigned head = vms->extent_heads[list];
+  vms->extent_heads[list] = pg;
+  if (head == VMSPACE_NIL) {
+    t->next = t->prev = pg;
+    return;
+  }
+
+  vmspace_tag_t *h = tag(vms, head);
+  t->next = head;
+  t->prev = h->prev;
+  tag(vms, h->prev)->next = pg;
+  h->prev = pg;
+}
+
+/* Take the free 'n' page extent at page 'pg' off its free list. */
+static void remove_extent(vmspace_t *vms, unsigned pg, unsigned n) {
+  unsigned list = log2_rounddown(n);
+  --vms->nfree[stat_order(list)];
+
+  vmspace_tag_t *t = tag(vms, pg);
+  if (t->next == pg) {
+    vms->extent_heads[list] = VMSPACE_NIL;
+    return;
+  }
+
+  tag(vms, t->prev)->next = t->next;
+  tag(vms, t->next)->prev = t->prev;
+  if (vms->extent_heads[list] == pg)
+    vms->extent_heads[list] = t->next;
+}
+
+/* Allocate an extent of 'n' pages, returning its first page or VMSPACE_NIL
+   if there is no free extent large enough. */
+static unsigned alloc_extent(vmspace_t *vms, unsigned n) {
+  unsigned pg = VMSPACE_NIL;
+
+  /* Any extent on a list at or above log2_roundup(n) is large enough, so
+     take the first one found. */
+  for (unsigned l = log2_roundup(n); l < VMSPACE_EXTENT_LISTS; ++l) {
+    if (vms->extent_heads[l] != VMSPACE_NIL) {
+      pg = vms->extent_heads[l];
+      break;
+    }
+  }
+
+  /* Failing that, the list below may hold an extent that is big enough but
+     not a power of two. */
+  unsigned l = log2_rounddown(n);
+  if (pg == VMSPACE_NIL && l != log2_roundup(n) &&
+      vms->extent_heads[l] != VMSPACE_NIL) {
+    unsigned i = vms->extent_heads[l];
+    do {
+      if ((tag(vms, i)->tag >> 1) >= n) {
+        pg = i;
+        break;
+      }
+      i = tag(vms, i)->next;
+    } while (i != vms->extent_heads[l]);
+  }
+
+  if (pg == VMSPACE_NIL)
+    return VMSPACE_NIL;
+
+  /* Keep the front of the extent and give back the rest. */
+  unsigned sz = tag(vms, pg)->tag >> 1;
+  remove_extent(vms, pg, sz);
+  if (sz > n)
+    insert_extent(vms, pg + n, sz - n);
+  set_tags(vms, pg, n, 0);
+  return pg;
+}
+
+/* Free the 'n' page extent at page 'pg', coalescing it with its neighbours
+   if they are free. */
+static void free_extent(vmspace_t *vms, unsigned pg, unsigned n) {
+  if (pg + n > vms->npages || tag(vms, pg)->tag != (n << 1))
+    panic("vmspace_free: address and size do not match an allocation!");
+
+  if (pg > 0 && (tag(vms, pg - 1)->tag & 1)) {
+    unsigned prev_n = tag(vms, pg - 1)->tag >> 1;
+    remove_extent(vms, pg - prev_n, prev_n);
+    pg -= prev_n;
+    n += prev_n;
+  }
+  if (pg + n < vms->npages && (tag(vms, pg + n)->tag & 1)) {
+    unsigned next_n = tag(vms, pg + n)->tag >> 1;
+    remove_extent(vms, pg + n, next_n);
+    n += next_n;
+  }
+  insert_extent(vms, pg, n);
+}
+
+static uintptr_t alloc_range(vmspace_t *vms, unsigned sz);
+static void free_range(vmspace_t *vms, unsigned sz, uintptr_t addr);
+
+/* Allocate a page for the lazy bitmap from the vmspace itself. Called
+   with vms->lock held. Returns NULL if there is no address space or
+   memory for it. */
+static void *lazy_alloc(unsigned sz, void *p) {
+  vmspace_t *vms = (vmspace_t*)p;
+  uintptr_t addr = alloc_range(vms, get_page_size());
+  if (!addr)
+    return NULL;
+
+  uint64_t pg = alloc_page(PAGE_REQ_NONE|PAGE_REQ_ZEROED);
+  if (pg == ~0ULL || map(addr, pg, 1, PAGE_WRITE) == -1) {
+    if (pg != ~0ULL)
+      free_page(pg);
+    free_range(vms, get_page_size(), addr);
+    return NULL;
+  }
+  return (void*)addr;
+}
+static void lazy_free(void *ptr, void *p) {
+  free(ptr, NULL);
+  free_range((vmspace_t*)p, get_page_size(), (uintptr_t)ptr);
+}
+
+static void init_common(vmspace_t *vms, uintptr_t addr, uintptr_t sz) {
   vms->start = addr;
   vms->size = sz;
   spinlock_init(&vms->lock);
+  memset((uint8_t*)vms->nfree, 0, sizeof(vms->nfree));
+  memset((uint8_t*)vms->allocs, 0, sizeof(vms->allocs));
+  memset((uint8_t*)vms->frees, 0, sizeof(vms->frees));
 
-  uintptr_t _sz = sz;
-  for (unsigned i = 0; i <= MAX_BUDDY_SZ_LOG2-MIN_BUDDY_SZ_LOG2; ++i) {
-    /* The maximum size this bitmap could grow to. */
-    uintptr_t max_bm_sz = (_sz >> (i+MIN_BUDDY_SZ_LOG2)) / 8;
+  /* Quantum caching is off until asked for. Zeroing the caches leaves
+     their locks released. */
+  vms->qcache_max = 0;
+  memset((uint8_t*)vms->qcaches, 0, sizeof(vms->qcaches));
 
-    /* Round up to the page size. */
-    unsigned pgsz = get_page_size();
-    max_bm_sz = (max_bm_sz & ~(pgsz-1)) + pgsz;
+  xbitmap_init(&vms->lazy, get_page_size(), lazy_alloc, lazy_free, vms);
+  vms->lazy.alloc_zeroed = 1;
+  vms->next_lazy = NULL;
+  vms->on_lazy_list = 0;
+}
+
+int vmspace_init_extents(vmspace_t *vms, uintptr_t addr, uintptr_t sz) {
+  init_common(vms, addr, sz);
+  vms->extents = 1;
+  for (unsigned i = 0; i < VMSPACE_EXTENT_LISTS; ++i)
+    vms->extent_heads[i] = VMSPACE_NIL;
+
+  /* The boundary tags live at the top of the region. */
+  unsigned pgsz = get_page_size();
+  unsigned npages = sz / pgsz;
+  uintptr_t tags_sz = (npages * sizeof(vmspace_tag_t) + pgsz - 1) & ~(pgsz-1);
+  if (tags_sz >= sz)
+    return -1;
+
+  vms->tags = (vmspace_tag_t*)(addr + sz - tags_sz);
+  vms->npages = (sz - tags_sz) / pgsz;
+  insert_extent(vms, 0, vms->npages);
+  return 0;
+}
+
+int vmspace_init(vmspace_t *vms, uintptr_t addr, uintptr_t sz) {
+  unsigned pgsz = get_page_size();
+  if ((addr & (pgsz-1)) || (sz & (pgsz-1)) || sz == 0)
+    return -1;
+
+  init_common(vms, addr, sz);
+  vms->extents = 0;
 
-    sz -= max_bm_sz;
-    vms->order_alloc_ptrs[i] = addr + sz;
+  /* The free list links live at the top of the region, one for every block
+     of every order that overlaps it. Their pages are only mapped when
+     touched. */
+  uintptr_t end = addr + sz;
+  for (unsigned i = 0; i < VMSPACE_NUM_ORDERS; ++i) {
+    uintptr_t nblocks = ((addr + (sz - 1)) >> (i+MIN_BUDDY_SZ_LOG2)) -
+      first_block(vms, i) + 1;
+    uintptr_t links_sz = (nblocks * sizeof(vmspace_link_t) + pgsz - 1) &
+      ~(pgsz-1);
+    if (links_sz >= end - addr)
+      return -1;
 
-    xbitmap_init(&vms->orders[i], get_page_size(), alloc, free, (void*)&vms->order_alloc_ptrs[i]);
+    end -= links_sz;
+    vms->links[i] = (vmspace_link_t*)end;
+    vms->free_heads[i] = VMSPACE_NIL;
   }
 
-  unsigned i = MAX_BUDDY_SZ_LOG2;
-  uintptr_t idx = 0;
-  while (sz > 0 && i >= MIN_BUDDY_SZ_LOG2) {
-    unsigned _sz = 1U << i;
-    if (sz >= _sz) {
-      xbitmap_set(&vms->orders[i-MIN_BUDDY_SZ_LOG2], idx++);
-      sz -= _sz;
-    } else {
-      --i;
-      idx <<= 1;
-    }
+  /* Split the rest into the largest naturally aligned blocks that fit,
+     lowest addresses first. */
+  while (end - addr >= pgsz) {
+    unsigned log_sz = MAX_BUDDY_SZ_LOG2;
+    while ((addr & ((1U << log_sz) - 1)) || end - addr < (1U << log_sz))
+      --log_sz;
+    insert_free(vms, log_sz - MIN_BUDDY_SZ_LOG2, addr >> log_sz);
+    addr += 1U << log_sz;
   }
-  if (sz >= (1U<<MIN_BUDDY_SZ_LOG2) && i == MIN_BUDDY_SZ_LOG2)
-    panic("vmspace_init: algorithmic error!");
 
   return 0;
 }
 
-uintptr_t vmspace_alloc(vmspace_t *vms, unsigned sz, int alloc_phys) {
-  spinlock_acquire(&vms->lock);
-
+/* Allocate a buddy block of at least 'sz' bytes, returning 0 if there is
+   none. */
+static uintptr_t alloc_block(vmspace_t *vms, unsigned sz) {
   unsigned log_sz = log2_roundup(sz);
   if (log_sz > MAX_BUDDY_SZ_LOG2)
-    panic("vmspace_alloc had request that was too large to handle!");
+    return 0;
 
   unsigned orig_log_sz = log_sz;
 
-  /* Search for a free block - we may have to increase the size of the
-     block to find a free one. */
-  unsigned idx;
-  while (log_sz <= MAX_BUDDY_SZ_LOG2) {
-    int order_idx = log_sz - MIN_BUDDY_SZ_LOG2;
-    
-    idx = xbitmap_first_set(&vms->orders[order_idx]);
-    if (idx != ~0U)
-      break;
+  /* Find the smallest order with a free block - we may have to increase the
+     size of the block to find a free one. */
+  while (log_sz <= MAX_BUDDY_SZ_LOG2 &&
+         vms->free_heads[log_sz - MIN_BUDDY_SZ_LOG2] == VMSPACE_NIL)
     ++log_sz;
-  }
+  if (log_sz > MAX_BUDDY_SZ_LOG2)
+    return 0;
 
-  /* We may have to split blocks to get back to a block of the minimum size. */
+  int order_idx = log_sz - MIN_BUDDY_SZ_LOG2;
+  unsigned idx = vms->free_heads[order_idx];
+  remove_free(vms, order_idx, idx);
+
+  /* We may have to split blocks to get back to a block of the requested
+     size. Keep the lower half and free the upper half each time. */
   for (; log_sz != orig_log_sz; --log_sz) {
-    int order_idx = log_sz - MIN_BUDDY_SZ_LOG2;
+    order_idx = log_sz - MIN_BUDDY_SZ_LOG2;
+    idx <<= 1;
+    push_free(vms, order_idx-1, idx+1);
+  }
+  ++vms->allocs[log_sz - MIN_BUDDY_SZ_LOG2];
 
-    /* We're splitting a block, so deallocate it first... */
-    xbitmap_clear(&vms->orders[order_idx], idx);
+  return (uintptr_t)idx << log_sz;
+}
 
-    /* Then set both its children as free in the next order. */
-    idx <<= 1;
-    xbitmap_set(&vms->orders[order_idx-1], idx);
-    xbitmap_set(&vms->orders[order_idx-1], idx+1);
+/* Free the buddy block of 'sz' bytes at 'addr', merging it with its buddy
+   for as long as that is free. */
+static void free_block(vmspace_t *vms, unsigned sz, uintptr_t addr) {
+  unsigned log_sz = log2_roundup(sz);
+  unsigned idx = addr >> log_sz;
+  ++vms->frees[log_sz - MIN_BUDDY_SZ_LOG2];
+
+  unsigned order_idx = log_sz - MIN_BUDDY_SZ_LOG2;
+  while (order_idx < VMSPACE_NUM_ORDERS-1 &&
+         has_link(vms, order_idx, BUDDY(idx)) &&
+         link(vms, order_idx, BUDDY(idx))->is_free) {
+    remove_free(vms, order_idx, BUDDY(idx));
+    idx >>= 1;
+    ++order_idx;
   }
+  push_free(vms, order_idx, idx);
+}
 
-  /* Mark the block as not free. */
-  int order_idx = log_sz - MIN_BUDDY_SZ_LOG2;
-  xbitmap_clear(&vms->orders[order_idx], idx);
+/* Return the number of pages an 'sz' byte allocation spans. */
+static unsigned num_pages(unsigned sz) {
+  unsigned pgsz = get_page_size();
+  return sz ? (sz + pgsz - 1) / pgsz : 1;
+}
 
-  uintptr_t addr = vms->start + (idx << log_sz);
+/* Allocate 'sz' bytes of address space from the underlying allocator,
+   returning 0 if there is not enough. Must be called with vms->lock
+   held. */
+static uintptr_t alloc_range(vmspace_t *vms, unsigned sz) {
+  if (!vms->extents)
+    return alloc_block(vms, sz);
 
-  if (alloc_phys) {
-    unsigned pgsz = get_page_size();
-    for (unsigned i = 0; i < sz; i += pgsz) {
-      uint64_t p = alloc_page(PAGE_REQ_NONE);
-      if (p == ~0ULL)
-        panic("vmspace_alloc: alloc_page failed!");
-      if (map(addr + i, p, 1, alloc_phys) == -1)
-        panic("vmspace_alloc: map failed!");
+  unsigned n = num_pages(sz);
+  unsigned pg = alloc_extent(vms, n);
+  if (pg == VMSPACE_NIL)
+    return 0;
+  ++vms->allocs[stat_order(log2_roundup(n))];
+  return vms->start + pg * get_page_size();
+}
+
+/* Give 'sz' bytes at 'addr' back to the underlying allocator. Must be
+   called with vms->lock held. */
+static void free_range(vmspace_t *vms, unsigned sz, uintptr_t addr) {
+  if (!vms->extents) {
+    free_block(vms, sz, addr);
+    return;
+  }
+
+  unsigned n = num_pages(sz);
+  ++vms->frees[stat_order(log2_roundup(n))];
+  free_extent(vms, (addr - vms->start) / get_page_size(), n);
+}
+
+/* Take a range of 'n' pages from its quantum cache, or return 0 if the
+   cache is empty. */
+static uintptr_t qcache_get(vmspace_t *vms, unsigned n) {
+  vmspace_qcache_t *qc = &vms->qcaches[n-1];
+  uintptr_t addr = 0;
+
+  spinlock_acquire(&qc->lock);
+  if (qc->n > 0) {
+    addr = qc->addrs[--qc->n];
+    ++qc->hits;
+  } else {
+    ++qc->misses;
+  }
+  spinlock_release(&qc->lock);
+  return addr;
+}
+
+/* Keep the 'n' page range at 'addr' in its quantum cache. Returns zero if
+   the cache is full. */
+static int qcache_put(vmspace_t *vms, unsigned n, uintptr_t addr) {
+  vmspace_qcache_t *qc = &vms->qcaches[n-1];
+  int ret = 0;
+
+  spinlock_acquire(&qc->lock);
+  if (qc->n < VMSPACE_QCACHE_DEPTH) {
+    qc->addrs[qc->n++] = addr;
+    ret = 1;
+  }
+  spinlock_release(&qc->lock);
+  return ret;
+}
+
+/* Give every range held in the quantum caches back to the underlying
+   allocator. Returns nonzero if there were any. */
+static int qcache_drain(vmspace_t *vms) {
+  int ret = 0;
+  for (unsigned i = 0; i < vms->qcache_max; ++i) {
+    vmspace_qcache_t *qc = &vms->qcaches[i];
+    spinlock_acquire(&qc->lock);
+    spinlock_acquire(&vms->lock);
+    while (qc->n > 0) {
+      free_range(vms, (i+1) * get_page_size(), qc->addrs[--qc->n]);
+      ret = 1;
     }
+    spinlock_release(&vms->lock);
+    spinlock_release(&qc->lock);
   }
+  return ret;
+}
+
+/* The vmspaces that have made lazy allocations. */
+static vmspace_t *lazy_vmspaces;
+static spinlock_t lazy_vmspaces_lock = SPINLOCK_RELEASED;
 
+/* Record the 'sz' bytes at 'addr' as a lazy allocation, to be mapped with
+   'flags' when touched. Returns -1, having recorded nothing, if there is no
+   memory for the lazy bitmap. */
+static int reserve_lazy(vmspace_t *vms, uintptr_t addr, unsigned sz,
+                        unsigned flags) {
+  unsigned first = (addr - vms->start) / get_page_size();
+  unsigned n = num_pages(sz);
+
+  spinlock_acquire(&vms->lock);
+  int ret = 0;
+  for (unsigned pg = first; pg < first + n && ret == 0; ++pg) {
+    ret = xbitmap_set(&vms->lazy, pg * VMSPACE_LAZY_BITS);
+    for (unsigned b = 1; b < VMSPACE_LAZY_BITS && ret == 0; ++b)
+      if (flags & (1U << (b-1)))
+        ret = xbitmap_set(&vms->lazy, pg * VMSPACE_LAZY_BITS + b);
+  }
+  /* Clearing never allocates, so this cannot fail in turn. */
+  if (ret == -1)
+    xbitmap_clear_range(&vms->lazy, first * VMSPACE_LAZY_BITS,
+                        n * VMSPACE_LAZY_BITS);
   spinlock_release(&vms->lock);
-  return addr;
+  if (ret == -1)
+    return -1;
+
+  spinlock_acquire(&lazy_vmspaces_lock);
+  if (!vms->on_lazy_list) {
+    vms->next_lazy = lazy_vmspaces;
+    lazy_vmspaces = vms;
+    vms->on_lazy_list = 1;
+  }
+  spinlock_release(&lazy_vmspaces_lock);
+  return 0;
 }
 
-void vmspace_free(vmspace_t *vms, unsigned sz, uintptr_t addr, int free_phys) {
+/* If the 'sz' bytes at 'addr' are a lazy allocation, forget it and return
+   nonzero. */
+static int release_lazy(vmspace_t *vms, uintptr_t addr, unsigned sz) {
+  if (!vms->on_lazy_list)
+    return 0;
+
+  unsigned first = (addr - vms->start) / get_page_size();
   spinlock_acquire(&vms->lock);
+  int lazy = xbitmap_isset(&vms->lazy, first * VMSPACE_LAZY_BITS);
+  if (lazy)
+    xbitmap_clear_range(&vms->lazy, first * VMSPACE_LAZY_BITS,
+                        num_pages(sz) * VMSPACE_LAZY_BITS);
+  spinlock_release(&vms->lock);
+  return lazy;
+}
 
-  if (free_phys) {
-    unsigned pgsz = get_page_size();
-    for (unsigned i = 0; i < sz; i += pgsz) {
-      uint64_t p = get_mapping(addr + i, NULL);
-      if (p == ~0ULL)
-        panic("vmspace_free asked to free_phys but mapping did not exist!");
-      free_page(p);
-      unmap(addr + i, 1);
-    }
+/* Return the PAGE_* flags lazy page 'pg' of 'vms' is to be mapped with, or
+   -1 if it is not part of a lazy allocation. Must be called with vms->lock
+   held. */
+static int lazy_flags_locked(vmspace_t *vms, unsigned pg) {
+  if (!xbitmap_isset(&vms->lazy, pg * VMSPACE_LAZY_BITS))
+    return -1;
+  int flags = 0;
+  for (unsigned b = 1; b < VMSPACE_LAZY_BITS; ++b)
+    if (xbitmap_isset(&vms->lazy, pg * VMSPACE_LAZY_BITS + b))
+      flags |= 1 << (b-1);
+  return flags;
+}
+
+int vmspace_fault(uintptr_t addr) {
+  spinlock_acquire(&lazy_vmspaces_lock);
+  vmspace_t *vms = lazy_vmspaces;
+  while (vms && (addr < vms->start || addr - vms->start >= vms->size))
+    vms = vms->next_lazy;
+  spinlock_release(&lazy_vmspaces_lock);
+  if (!vms)
+    return -1;
+
+  unsigned pgsz = get_page_size();
+  unsigned pg = (addr - vms->start) / pgsz;
+  uintptr_t v = vms->start + pg * pgsz;
+
+  /* Check the page is lazy before allocating, so that stray faults cost
+     nothing. */
+  spinlock_acquire(&vms->lock);
+  int flags = lazy_flags_locked(vms, pg);
+  int mapped = flags != -1 && is_mapped(v);
+  spinlock_release(&vms->lock);
+  if (flags == -1)
+    return -1;
+  if (mapped)
+    return 0;
+
+  /* Allocating and zeroing may be slow, so do it without the lock. */
+  uint64_t p = alloc_page(PAGE_REQ_NONE|PAGE_REQ_ZEROED);
+  if (p == ~0ULL)
+    return -1;
+
+  /* The range may have been freed, or another core may have faulted the
+     page in first, while the lock was dropped. */
+  int ret = -1;
+  spinlock_acquire(&vms->lock);
+  flags = lazy_flags_locked(vms, pg);
+  if (flags != -1 && is_mapped(v)) {
+    ret = 0;
+  } else if (flags != -1 && map(v, p, 1, flags) == 0) {
+    p = ~0ULL;
+    ret = 0;
   }
+  spinlock_release(&vms->lock);
 
-  uintptr_t offs = addr - vms->start;
-  unsigned log_sz = log2_roundup(sz);
-  unsigned idx = offs >> log_sz;
+  if (p != ~0ULL)
+    free_page(p);
+  return ret;
+}
 
-  while (log_sz >= MIN_BUDDY_SZ_LOG2) {
-    int order_idx = log_sz - MIN_BUDDY_SZ_LOG2;
+void vmspace_enable_qcache(vmspace_t *vms, unsigned max_pages) {
+  if (max_pages > VMSPACE_QCACHE_MAX)
+    max_pages = VMSPACE_QCACHE_MAX;
+  vms->qcache_max = max_pages;
+}
 
-    /* Mark this node free. */
-    xbitmap_set(&vms->orders[order_idx], idx);
+uintptr_t vmspace_alloc(vmspace_t *vms, unsigned sz, int alloc_phys) {
+  unsigned npages = num_pages(sz);
 
-    /* Is this node's buddy also free? */
-    if (xbitmap_isclear(&vms->orders[order_idx], BUDDY(idx)))
-      /* no :( */
-      break;
+  uintptr_t addr = 0;
+  if (npages <= vms->qcache_max)
+    addr = qcache_get(vms, npages);
 
-    /* Mark them both non free. */
-    xbitmap_clear(&vms->orders[order_idx], idx);
-    xbitmap_clear(&vms->orders[order_idx], BUDDY(idx));
+  if (!addr) {
+    spinlock_acquire(&vms->lock);
+    addr = alloc_range(vms, sz);
+    spinlock_release(&vms->lock);
 
-    /* Move up an order. */
-    idx >>= 1;
-    ++log_sz;
+    /* Address space held in the quantum caches may be all that is
+       left. */
+    if (!addr && qcache_drain(vms)) {
+      spinlock_acquire(&vms->lock);
+      addr = alloc_range(vms, sz);
+      spinlock_release(&vms->lock);
+    }
+    if (!addr)
+      return 0;
+  }
+
+  if (alloc_phys & VMSPACE_LAZY) {
+    if (reserve_lazy(vms, addr, sz,
+                     alloc_phys & ~(VMSPACE_LAZY|VMSPACE_ZEROED)) == -1) {
+      vmspace_free(vms, sz, addr, /*free_phys=*/0);
+      return 0;
+    }
+  } else if (alloc_phys) {
+    int req = (alloc_phys & VMSPACE_ZEROED) ?
+      PAGE_REQ_NONE|PAGE_REQ_ZEROED : PAGE_REQ_NONE;
+    alloc_phys &= ~VMSPACE_ZEROED;
+
+    unsigned pgsz = get_page_size();
+    uint64_t pages[PAGE_BATCH];
+    for (unsigned i = 0; i < sz; ) {
+      /* Use large pages for big allocations, to save on page tables and
+         TLB entries. */
+      if (large_page_fits(addr, i, sz) && map_large(addr + i, req, alloc_phys)) {
+        i += get_large_page_size();
+        continue;
+      }
+
+      unsigned n = batch_size(addr, i, sz);
+      unsigned mapped = 0;
+      if (alloc_pages(n, req, pages) == 0) {
+        mapped = map_pages(addr + i, pages, n, alloc_phys);
+        if (mapped < n)
+          free_pages(n - mapped, &pages[mapped]);
+      }
+
+      if (mapped < n) {
+        /* Out of memory. Undo what we have done and let the caller
+           decide how to cope, rather than panicking. */
+        unmap_and_free(addr, i + mapped*pgsz);
+        vmspace_free(vms, sz, addr, /*free_phys=*/0);
+        return 0;
+      }
+      i += n*pgsz;
+    }
   }
 
+  return addr;
+}
+
+void vmspace_free(vmspace_t *vms, unsigned sz, uintptr_t addr, int free_phys) {
+  /* Only the pages of a lazy allocation that were touched are mapped. */
+  if (release_lazy(vms, addr, sz))
+    unmap_and_free_lazy(addr, sz);
+  else if (free_phys)
+    unmap_and_free(addr, sz);
+
+  unsigned npages = num_pages(sz);
+  if (npages <= vms->qcache_max && qcache_put(vms, npages, addr))
+    return;
+
+  spinlock_acquire(&vms->lock);
+  free_range(vms, sz, addr);
   spinlock_release(&vms->lock);
 }
+
+void vmspace_get_stats(vmspace_t *vms, vmspace_stats_t *s) {
+  spinlock_acquire(&vms->lock);
+  memcpy((uint8_t*)s->free_blocks, (uint8_t*)vms->nfree, sizeof(s->free_blocks));
+  memcpy((uint8_t*)s->allocs, (uint8_t*)vms->allocs, sizeof(s->allocs));
+  memcpy((uint8_t*)s->frees, (uint8_t*)vms->frees, sizeof(s->frees));
+  spinlock_release(&vms->lock);
+
+  for (unsigned i = 0; i < VMSPACE_QCACHE_MAX; ++i) {
+    vmspace_qcache_t *qc = &vms->qcaches[i];
+    spinlock_acquire(&qc->lock);
+    s->qcache_hits[i] = qc->hits;
+    s->qcache_misses[i] = qc->misses;
+    s->qcache_cached[i] = qc->n;
+    spinlock_release(&qc->lock);
+  }
+}
@@ -155,8 +155,26 @@ mboot:  dd      MBOOT_HEADER_MAGIC
         ;; Kernel entry point from bootloader.
         ;; At this point EBX is a pointer to the multiboot struct.
 global _start:function _start.end-_start
-_start: mov     eax, pd         ; MAGIC START!
-        mov     dword [eax], pt + 3
+_start: mov     esi, ebx        ; MAGIC START! CPUID clobbers EBX.
+        mov     eax, 1
+        cpuid
+        mov     ebx, esi
+
+        mov     eax, pd
+        test    edx, 0x8        ; 4MB pages supported (CPUID.01h:EDX.PSE)?
+        jz      .nopse
+
+        mov     ecx, cr4
+        or      ecx, 0x10       ; Enable 4MB pages (CR4.PSE).
+        mov     cr4, ecx
+
+        ;; Map the first 4MB at both 0x0 and 0xC0000000 with one large page.
+        mov     dword [eax], 0x83
+        mov     dword [eax+0xC00], 0x83
+        jmp     .paging
+
+        ;; Otherwise map the same 4MB with one page table.
+.nopse: mov     dword [eax], pt + 3
         mov     dword [eax+0xC00], pt + 3
 
         mov     edx, pt
@@ -169,6 +187,7 @@ _start: mov     eax, pd         ; MAGIC START!
         cmp     ecx, 1024
         jnz     .loop
 
+.paging:
         mov     eax, pd+3
         mov     cr3, eax
         mov     eax, cr0
@@ -4,18 +4,22 @@
 
 extern multiboot_t mboot;
 
-static void maybe_init_vmm(uint64_t page) {
+/* Give the range [base, end) to the physical memory manager, first taking
+   from it any pages the VMM still needs to bootstrap itself. */
+static void add_range(uint64_t base, uint64_t end) {
   static uintptr_t initial_pages[NUM_INITIAL_PAGES];
   static int num_initial_pages = 0;
 
-  if (num_initial_pages < NUM_INITIAL_PAGES) {
-    initial_pages[num_initial_pages++] = (uintptr_t)page;
+  base = (base + 0xFFF) & ~0xFFFULL;
+  while (num_initial_pages < NUM_INITIAL_PAGES && base + 0x1000 <= end) {
+    initial_pages[num_initial_pages++] = (uintptr_t)base;
+    base += 0x1000;
     if (num_initial_pages == NUM_INITIAL_PAGES)
       init_virtual_memory(initial_pages);
-    return;
   }
 
-  free_page(page);
+  if (base < end)
+    pmm_add_range(base, end - base);
 }
 
 static int free_memory() {
@@ -26,11 +30,14 @@ static int free_memory() {
   while (i < mboot.mmap_addr+mboot.mmap_length) {
     multiboot_mmap_entry_t *entry = (multiboot_mmap_entry_t*)i;
 
-    if (MBOOT_IS_MMAP_TYPE_RAM(entry->type)) {
-      for (uint32_t j = entry->base_addr; j < entry->base_addr+entry->length; j += 0x1000) {
-        maybe_init_vmm(j);
-      }
-    }
+    /* We can only map physical memory below 4GB, so ignore anything
+       above that. */
+    uint64_t end = entry->base_addr + entry->length;
+    if (end > 0x100000000ULL)
+      end = 0x100000000ULL;
+
+    if (MBOOT_IS_MMAP_TYPE_RAM(entry->type) && entry->base_addr < end)
+      add_range(entry->base_addr, end);
     kprintf("e: sz %x addr %x len %x ty %x\n", entry->size, entry->base_addr, entry->length, entry->type);
 
     i += entry->size + 4;
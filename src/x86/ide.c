@@ -36,8 +36,13 @@ static void send_chip_select(uint16_t base, uint16_t cs) {
   last_cs = cs;
 }
 
-static void send_lba_command(ide_dev_t *dev, uint64_t addr,
+/* Sends a command transferring 'nbytes' bytes starting at 'addr'. 'nbytes'
+   may be at most 128KB, as the sector count register is 8 bits wide (zero
+   means 256 sectors). */
+static void send_lba_command(ide_dev_t *dev, uint64_t addr, unsigned nbytes,
                              uint8_t cmd28, uint8_t cmd48) {
+  assert(nbytes > 0 && nbytes <= 256*512 && (nbytes & 511) == 0 &&
+         "Transfer must be 1-256 whole sectors!");
   assert((addr & 0x3F) == 0 && "Addr must be a multiple of 512!");
   /* Convert addr into sectors. */
   addr >>= 10;
@@ -50,6 +55,7 @@ static void send_lba_command(ide_dev_t *dev, uint64_t addr,
     uint8_t head = ((addr>>24) & 0x0F) | ((dev->chip_select) << 4)
       | 0x70;
     outb(dev->base+ATA_REG_HDDEVSEL, head);
+    outb(dev->base+ATA_REG_SECCOUNT0, (nbytes / 512) & 0xFF);
     outb(dev->base+ATA_REG_LBA0, addr & 0xFF);
     outb(dev->base+ATA_REG_LBA1, (addr>>8) & 0xFF);
     outb(dev->base+ATA_REG_LBA2, (addr>>16) & 0xFF);
@@ -58,8 +64,15 @@ static void send_lba_command(ide_dev_t *dev, uint64_t addr,
   }
 }
 
-static void dma_setup(ide_dev_t *dev, uintptr_t buf,
-                      unsigned size, unsigned write) {
+/* Returns the number of bytes described by a PRDT entry. */
+static unsigned prd_nbytes(ide_prdt_t *prd) {
+  return prd->nbytes ? prd->nbytes : 0x10000;
+}
+
+/* Sets up the PRDT for a DMA operation, returning the number of entries
+   used. */
+static unsigned dma_setup(ide_dev_t *dev, uintptr_t buf,
+                          unsigned size, unsigned write) {
   assert((size & 0xFFF) == 0 && "DMA read size must be a multiple of 4K!");
   assert((buf & 0xFFF) == 0 && "DMA read buffer must be page aligned!");
   assert(size <= 0x200000 && "DMA size of one operation cannot be > 2MB!");
@@ -67,18 +80,31 @@ static void dma_setup(ide_dev_t *dev, uintptr_t buf,
   send_chip_select(dev->base, dev->chip_select);
   
   unsigned flags;
-  /* Set up the PRDT with descriptors for this operation. */
-  unsigned i;
-  for (i = 0; i < size; i += 0x1000) {
+  /* Set up the PRDT with descriptors for this operation, extending the
+     previous entry where the next page follows it physically. */
+  unsigned n = 0;
+  for (unsigned i = 0; i < size; i += 0x1000) {
     uint64_t phys = get_mapping(buf+i, &flags);
     assert(phys != ~0ULL && "Page was not mapped!");
     assert(phys <= 0xFFFFFFFFU &&
            "DMA page must be in lower 4GB of phys memory!");
-    dev->prdt[i].addr = phys;
-    dev->prdt[i].nbytes = 4096;
-    dev->prdt[i].resvd = 0;
+
+    if (n > 0) {
+      ide_prdt_t *prev = &dev->prdt[n-1];
+      /* nbytes wraps to zero (meaning 64KB) when the entry fills. */
+      if (prev->nbytes != 0 && phys == prev->addr + prev->nbytes &&
+          (phys & 0xFFFF) != 0) {
+        prev->nbytes += 4096;
+        continue;
+      }
+    }
+
+    dev->prdt[n].addr = phys;
+    dev->prdt[n].nbytes = 4096;
+    dev->prdt[n].resvd = 0;
+    ++n;
   }
-  dev->prdt[i].resvd |= IDE_PRDT_LAST;
+  dev->prdt[n-1].resvd |= IDE_PRDT_LAST;
 
   /* Ensure interrupts are enabled. */
   /* FIXME: add #defines for this. */
@@ -92,34 +118,40 @@ static void dma_setup(ide_dev_t *dev, uintptr_t buf,
 
   outb(dev->busmaster+ATA_BUSMASTER_CMD, ATA_BUSMASTER_START |
        ((write) ? ATA_BUSMASTER_WRITE : ATA_BUSMASTER_READ));
+
+  return n;
 }
 
 static void dma_start_read(ide_dev_t *dev, uintptr_t buf,
                            unsigned size, uint64_t address,
                            semaphore_t *sema) {
-  dma_setup(dev, buf, size, 0);
+  unsigned n = dma_setup(dev, buf, size, 0);
 
-  dev->next_addr = address+4096;
-  dev->n = size/4096 - 1;
+  dev->next_addr = address + prd_nbytes(&dev->prdt[0]);
+  dev->n = n - 1;
+  dev->cur = 0;
   dev->sema = sema;
   kprintf("sema val init %d\n", dev->sema->val);
   dev->flags &= ~IDE_FLAG_WRITE;
   dev->flags &= ~IDE_FLAG_ERROR;
   dev->flags |= IDE_FLAG_OP_IN_PROGRESS;
-  send_lba_command(dev, address, ATA_CMD_READ_DMA, ATA_CMD_READ_DMA_EXT);
+  send_lba_command(dev, address, prd_nbytes(&dev->prdt[0]),
+                   ATA_CMD_READ_DMA, ATA_CMD_READ_DMA_EXT);
 }
 
 static void dma_start_write(ide_dev_t *dev, uintptr_t buf,
                             unsigned size, uint64_t address,
                             semaphore_t *sema) {
-  dma_setup(dev, buf, size, 1);
-  dev->next_addr = address+4096;
-  dev->n = size/4096 - 1;
+  unsigned n = dma_setup(dev, buf, size, 1);
+  dev->next_addr = address + prd_nbytes(&dev->prdt[0]);
+  dev->n = n - 1;
+  dev->cur = 0;
   dev->sema = sema;
   dev->flags |= IDE_FLAG_WRITE;
   dev->flags &= ~IDE_FLAG_ERROR;
   dev->flags |= IDE_FLAG_OP_IN_PROGRESS;
-  send_lba_command(dev, address, ATA_CMD_WRITE_DMA, ATA_CMD_WRITE_DMA_EXT);
+  send_lba_command(dev, address, prd_nbytes(&dev->prdt[0]),
+                   ATA_CMD_WRITE_DMA, ATA_CMD_WRITE_DMA_EXT);
 }
 
 static int ide_read(block_device_t *bdev, uint64_t offset, void *buf, uint64_t len) {
@@ -180,13 +212,14 @@ static int dma_handle_irq(struct regs *r, void *p) {
     return 0;
   }
 
-  /* Send the next address to read. */
-  send_lba_command(dev, dev->next_addr,
+  /* Send the next address to read, covering the next PRDT entry. */
+  unsigned nbytes = prd_nbytes(&dev->prdt[++dev->cur]);
+  send_lba_command(dev, dev->next_addr, nbytes,
                    (dev->flags & IDE_FLAG_WRITE) ?
                    ATA_CMD_WRITE_DMA : ATA_CMD_READ_DMA,
                    (dev->flags & IDE_FLAG_WRITE) ?
                    ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT);
-  dev->next_addr += 4096;
+  dev->next_addr += nbytes;
   dev->n--;
 
   return 0;
@@ -2,21 +2,35 @@
 #include "mmap.h"
 #include "stdio.h"
 #include "string.h"
+#include "vmspace.h"
 #include "x86/io.h"
 #include "x86/regs.h"
 
 #define X86_PRESENT 0x1
 #define X86_WRITE   0x2
 #define X86_USER    0x4
+#define X86_LARGE   0x80
 #define X86_EXECUTE 0x200
 #define X86_COW     0x400
 
 #define PAGE_DIR_IDX(x) (x>>22)
 #define PAGE_TABLE_IDX(x) (x>>12)
 
+/* unmap() reloads CR3 rather than invalidating each page when more than
+   this many pages are unmapped at once. */
+#define TLB_FLUSH_THRESHOLD 32
+
 static address_space_t *current = NULL;
 
 static spinlock_t global_vmm_lock = SPINLOCK_RELEASED;
+/* Protect the two MMAP_KERNEL_SCRATCH windows. Window 0 may be needed while
+   reclaiming memory; window 1 is only used by clone_address_space(), so it
+   can be held across an allocation. */
+static spinlock_t scratch_locks[2]; /* Zero, i.e. released. */
+/* Set once init_virtual_memory() has created the direct map. */
+static int direct_mapped = 0;
+
+unsigned x86_large_page_size = 0;
 
 static int from_x86_flags(int flags) {
   int f = 0;
@@ -24,8 +38,11 @@ static int from_x86_flags(int flags) {
   if (flags & X86_EXECUTE) f |= PAGE_EXECUTE;
   if (flags & X86_USER) f |= PAGE_USER;
   if (flags & X86_COW) f |= PAGE_COW;
+  if (flags & X86_LARGE) f |= PAGE_LARGE;
   return f;
 }
+/* Note that PAGE_LARGE is not translated: X86_LARGE is only meaningful in a
+   page directory entry. */
 static int to_x86_flags(int flags) {
   int f = 0;
   if (flags & PAGE_WRITE) f |= X86_WRITE;
@@ -35,6 +52,53 @@ static int to_x86_flags(int flags) {
   return f;
 }
 
+void *phys_to_virt(uint64_t p) {
+  if (!direct_mapped || p >= MMAP_DIRECT_END - MMAP_DIRECT)
+    return NULL;
+  return (void*)(uintptr_t)(MMAP_DIRECT + p);
+}
+
+uint64_t virt_to_phys(void *v) {
+  uintptr_t x = (uintptr_t)v;
+  if (!direct_mapped || x < MMAP_DIRECT || x >= MMAP_DIRECT_END)
+    return ~0ULL;
+  return x - MMAP_DIRECT;
+}
+
+/* Point scratch window 'w' at physical page 'p', or unmap it if 'p' is
+   ~0ULL. The page table covering the windows always exists, so this never
+   needs to allocate. scratch_locks[w] must be held. */
+static void *set_scratch(unsigned w, uint64_t p) {
+  uintptr_t v = MMAP_KERNEL_SCRATCH + w*0x1000;
+  uint32_t *page_table_entry =
+    (uint32_t*) (MMAP_PAGE_TABLES + PAGE_TABLE_IDX(v)*4);
+  uintptr_t *pv = (uintptr_t*)v;
+
+  *page_table_entry = (p == ~0ULL) ? 0 :
+    (p & 0xFFFFF000) | X86_PRESENT | X86_WRITE;
+  __asm__ volatile("invlpg %0" : : "m" (*pv));
+  return (void*)v;
+}
+
+/* Return a pointer through which physical page 'p' can be accessed. This is
+   its direct map address if it has one; otherwise scratch window 'w' is
+   locked and pointed at it until put_phys() is called. */
+static void *get_phys(unsigned w, uint64_t p) {
+  void *v = phys_to_virt(p);
+  if (v)
+    return v;
+
+  spinlock_acquire(&scratch_locks[w]);
+  return set_scratch(w, p);
+}
+
+static void put_phys(unsigned w, void *v) {
+  if ((uintptr_t)v == MMAP_KERNEL_SCRATCH + w*0x1000) {
+    set_scratch(w, ~0ULL);
+    spinlock_release(&scratch_locks[w]);
+  }
+}
+
 int clone_address_space(address_space_t *dest, int make_cow) {
   spinlock_acquire(&global_vmm_lock);
 
@@ -43,8 +107,7 @@ int clone_address_space(address_space_t *dest, int make_cow) {
   spinlock_init(&dest->lock);
   dest->directory = (uint32_t*)p;
 
-  map(MMAP_KERNEL_TMP1, p, 1, PAGE_WRITE);
-  uint32_t *d_dir = (uint32_t*)MMAP_KERNEL_TMP1;
+  uint32_t *d_dir = get_phys(1, p);
   uint32_t *s_dir = (uint32_t*)MMAP_PAGE_DIR;
 
   for (unsigned i = 0; i < 1023; ++i) {
@@ -52,27 +115,30 @@ int clone_address_space(address_space_t *dest, int make_cow) {
 
     int is_user = ! IS_KERNEL_ADDR( 0x400000 * i );
 
-    if (s_dir[i] & X86_PRESENT) {
+    /* Large pages have no table to copy, so are shared as-is. */
+    if ((s_dir[i] & X86_PRESENT) && !(s_dir[i] & X86_LARGE)) {
       if (is_user || i == 1022) {
         uint32_t p2 = alloc_page(PAGE_REQ_UNDER4GB);
         d_dir[i] = p2 | X86_WRITE | X86_USER | X86_PRESENT;
 
-        map(MMAP_KERNEL_TMP2, p2, 1, PAGE_WRITE);
-
-        uint32_t *d_table = (uint32_t*)MMAP_KERNEL_TMP2;
+        uint32_t *d_table = get_phys(0, p2);
         uint32_t *s_table = (uint32_t*)(MMAP_PAGE_TABLES + i*0x1000);
         for (unsigned j = 0; j < 1024; ++j) {
-          d_table[j] = s_table[j];
-          if (make_cow && is_user && s_table[j] & X86_WRITE) {
-            d_table[j] = (s_table[j] & ~X86_WRITE) | X86_COW;
+          if (make_cow && is_user && (s_table[j] & X86_PRESENT) &&
+              (s_table[j] & (X86_WRITE|X86_COW))) {
+            /* Both address spaces now share the page, so both must take
+               a copy before writing to it. */
+            s_table[j] = (s_table[j] & ~X86_WRITE) | X86_COW;
+            page_ref(s_table[j] & 0xFFFFF000);
           }
+          d_table[j] = s_table[j];
         }
 
         /* tables[1022][1023] is mapped to the directory for the recursive
            page dir trick. */
         if (i == 1022)
           d_table[1023] = p | X86_PRESENT | X86_WRITE;
-        unmap(MMAP_KERNEL_TMP2, 1);
+        put_phys(0, d_table);
       }
     }
   }
@@ -81,7 +147,11 @@ int clone_address_space(address_space_t *dest, int make_cow) {
      trick. */
   d_dir[1023] = p | X86_PRESENT | X86_WRITE;
 
-  unmap(MMAP_KERNEL_TMP1, 1);
+  put_phys(1, d_dir);
+
+  /* Flush the TLB, as our own writable mappings may have become CoW. */
+  if (make_cow)
+    write_cr3(read_cr3());
 
   spinlock_release(&global_vmm_lock);
 
@@ -97,71 +167,208 @@ address_space_t *get_current_address_space() {
   return current;
 }
 
-static int map_one_page(uintptr_t v, uint64_t p, unsigned flags) {
-  spinlock_acquire(&current->lock);
-
-  /* Quick sanity check - a page with CoW must not be writable. */
+/* Install a large page mapping 'v' to 'p'. Returns -1 if a page table
+   already covers 'v', in which case the caller should fall back to small
+   pages. */
+static int map_large_page(uintptr_t v, uint64_t p, unsigned flags) {
   if (flags & PAGE_COW)
     flags &= ~PAGE_WRITE;
 
+  spinlock_acquire(&current->lock);
+
   uint32_t *page_dir_entry = (uint32_t*) (MMAP_PAGE_DIR + PAGE_DIR_IDX(v)*4);
-  if ((*page_dir_entry & X86_PRESENT) == 0) {
-    uint64_t p = alloc_page(PAGE_REQ_UNDER4GB);
-    if (p == ~0ULL)
-      panic("alloc_page failed in map()!");
+  if (*page_dir_entry & X86_PRESENT) {
+    if (*page_dir_entry & X86_LARGE)
+      panic("Tried to map a page that was already mapped!");
+    spinlock_release(&current->lock);
+    return -1;
+  }
+
+  *page_dir_entry = (p & 0xFFC00000) | to_x86_flags(flags) | X86_LARGE |
+    X86_PRESENT;
+
+  spinlock_release(&current->lock);
+  return 0;
+}
 
-    *page_dir_entry = (p & 0xFFFFF000) | X86_PRESENT | X86_WRITE | X86_USER;
+/* Replace the large page covering 'v' with a page table mapping the same
+   memory with small pages. Returns -1 on failure. */
+static int split_large_page(uintptr_t v) {
+  uint32_t *page_dir_entry = (uint32_t*) (MMAP_PAGE_DIR + PAGE_DIR_IDX(v)*4);
+
+  uint64_t table = alloc_page(PAGE_REQ_UNDER4GB);
+  if (table == ~0ULL)
+    return -1;
 
-    memset((uint8_t*) (MMAP_PAGE_TABLES + PAGE_DIR_IDX(v)*0x1000), 0, 0x1000);
+  spinlock_acquire(&current->lock);
+  if ((*page_dir_entry & (X86_PRESENT|X86_LARGE)) != (X86_PRESENT|X86_LARGE)) {
+    /* Someone else got here first. */
+    spinlock_release(&current->lock);
+    free_page(table);
+    return 0;
   }
 
-  uint32_t *page_table_entry = (uint32_t*) (MMAP_PAGE_TABLES + PAGE_TABLE_IDX(v)*4);
-  if (*page_table_entry & X86_PRESENT)
-    panic("Tried to map a page that was already mapped!");
+  /* Fill the new table out of line, so the region stays mapped (it may
+     contain the code doing the splitting) until the directory entry is
+     switched over. */
+  uint32_t pde = *page_dir_entry;
+  uint32_t *t = get_phys(0, table);
+  for (unsigned i = 0; i < 1024; ++i)
+    t[i] = ((pde & 0xFFC00000) + i*0x1000) | (pde & 0xFFF & ~X86_LARGE);
+  put_phys(0, t);
 
-  *page_table_entry = (p & 0xFFFFF000) | (to_x86_flags(flags) | X86_PRESENT);
+  *page_dir_entry = (table & 0xFFFFF000) | X86_PRESENT | X86_WRITE | X86_USER;
+
+  /* Invalidate both the large page and the (previously bogus) view of its
+     page table through the recursive mapping. */
+  uintptr_t *pv = (uintptr_t*)(v & 0xFFC00000);
+  __asm__ volatile("invlpg %0" : : "m" (*pv));
+  pv = (uintptr_t*)(MMAP_PAGE_TABLES + PAGE_DIR_IDX(v)*0x1000);
+  __asm__ volatile("invlpg %0" : : "m" (*pv));
 
   spinlock_release(&current->lock);
   return 0;
 }
 
-int map(uintptr_t v, uint64_t p, int num_pages, unsigned flags) {
-  for (int i = 0; i < num_pages; ++i) {
-    if (map_one_page(v+i*0x1000, p+i*0x1000, flags) == -1)
-      return -1;
+/* Invalidate the TLB entries for 'num_pages' pages from 'v'. Past
+   TLB_FLUSH_THRESHOLD pages it is cheaper to flush the whole TLB by
+   reloading CR3. */
+static void flush_tlb(uintptr_t v, unsigned num_pages) {
+  if (num_pages > TLB_FLUSH_THRESHOLD) {
+    write_cr3(read_cr3());
+    return;
+  }
+  for (unsigned i = 0; i < num_pages; ++i) {
+    uintptr_t *pv = (uintptr_t*)(v + i*0x1000);
+    __asm__ volatile("invlpg %0" : : "m" (*pv));
   }
-  return 0;
 }
 
-static int unmap_one_page(uintptr_t v) {
-  spinlock_acquire(&current->lock);
-
+/* Map the 'num_pages' pages from 'v' to 'p', all of which lie within one
+   page table, under a single acquisition of the lock. */
+static int map_span(uintptr_t v, uint64_t p, unsigned num_pages,
+                    unsigned flags) {
   uint32_t *page_dir_entry = (uint32_t*) (MMAP_PAGE_DIR + PAGE_DIR_IDX(v)*4);
-  if ((*page_dir_entry & X86_PRESENT) == 0)
-    panic("Tried to unmap a page that doesn't have its table mapped!");
 
-  uint32_t *page_table_entry = (uint32_t*) (MMAP_PAGE_TABLES + PAGE_TABLE_IDX(v)*4);
-  if ((*page_table_entry & X86_PRESENT) == 0)
-    panic("Tried to unmap a page that isn't mapped!");
+  /* Allocate any page table needed before taking the lock, as the
+     allocation may reclaim memory, which can mean unmapping pages. */
+  uint64_t table = ~0ULL;
+  if ((*page_dir_entry & X86_PRESENT) == 0) {
+    table = alloc_page(PAGE_REQ_UNDER4GB|PAGE_REQ_ZEROED);
+    if (table == ~0ULL)
+      return -1;
+  }
 
-  *page_table_entry = 0;
+  spinlock_acquire(&current->lock);
 
-  /* Invalidate TLB entry. */
-  uintptr_t *pv = (uintptr_t*)v;
-  __asm__ volatile("invlpg %0" : : "m" (*pv));
+  if ((*page_dir_entry & X86_PRESENT) == 0) {
+    *page_dir_entry = (table & 0xFFFFF000) | X86_PRESENT | X86_WRITE | X86_USER;
+    table = ~0ULL;
+  } else if (*page_dir_entry & X86_LARGE) {
+    panic("Tried to map a page that was already mapped!");
+  }
+
+  uint32_t *page_table_entry = (uint32_t*) (MMAP_PAGE_TABLES + PAGE_TABLE_IDX(v)*4);
+  uint32_t x86_flags = to_x86_flags(flags) | X86_PRESENT;
+  for (unsigned i = 0; i < num_pages; ++i) {
+    if (page_table_entry[i] & X86_PRESENT)
+      panic("Tried to map a page that was already mapped!");
+    page_table_entry[i] = ((p + i*0x1000) & 0xFFFFF000) | x86_flags;
+  }
 
   spinlock_release(&current->lock);
+
+  /* Someone else created the page table while we were allocating. */
+  if (table != ~0ULL)
+    free_page(table);
   return 0;
 }
 
-int unmap(uintptr_t v, int num_pages) {  
-  for (int i = 0; i < num_pages; ++i) {
-    if (unmap_one_page(v+i*0x1000) == -1)
+int map(uintptr_t v, uint64_t p, int num_pages, unsigned flags) {
+  /* Quick sanity check - a page with CoW must not be writable. */
+  if (flags & PAGE_COW)
+    flags &= ~PAGE_WRITE;
+
+  int i = 0;
+  while (i < num_pages) {
+    uintptr_t v2 = v + i*0x1000;
+    uint64_t p2 = p + i*0x1000;
+
+    if ((flags & PAGE_LARGE) && x86_large_page_size &&
+        num_pages - i >= 1024 &&
+        (v2 & 0x3FFFFF) == 0 && (p2 & 0x3FFFFF) == 0 &&
+        map_large_page(v2, p2, flags) == 0) {
+      i += 1024;
+      continue;
+    }
+
+    /* Map up to the end of this page table in one go. */
+    unsigned n = 1024 - ((v2 >> 12) & 0x3FF);
+    if (n > (unsigned)(num_pages - i))
+      n = num_pages - i;
+    if (map_span(v2, p2, n, flags & ~PAGE_LARGE) == -1)
       return -1;
+    i += n;
   }
   return 0;
 }
 
+/* If a large page covers 'v' but the range being unmapped does not cover
+   all of it, split it. */
+static int split_partial(uintptr_t v, uintptr_t start, uintptr_t end) {
+  uint32_t *page_dir_entry = (uint32_t*) (MMAP_PAGE_DIR + PAGE_DIR_IDX(v)*4);
+  uintptr_t lp = v & 0xFFC00000;
+  if ((*page_dir_entry & X86_LARGE) && (lp < start || lp + 0x400000 > end))
+    return split_large_page(v);
+  return 0;
+}
+
+int unmap(uintptr_t v, int num_pages) {
+  if (num_pages <= 0)
+    return 0;
+  uintptr_t end = v + num_pages*0x1000;
+
+  /* Only the large pages at either end can be partly unmapped. Splitting
+     allocates, so do it before taking the lock. */
+  if (split_partial(v, v, end) == -1 ||
+      split_partial(end - 0x1000, v, end) == -1)
+    return -1;
+
+  spinlock_acquire(&current->lock);
+
+  uintptr_t v2 = v;
+  while (v2 < end) {
+    uint32_t *page_dir_entry = (uint32_t*) (MMAP_PAGE_DIR + PAGE_DIR_IDX(v2)*4);
+    if ((*page_dir_entry & X86_PRESENT) == 0)
+      panic("Tried to unmap a page that doesn't have its table mapped!");
+
+    if (*page_dir_entry & X86_LARGE) {
+      *page_dir_entry = 0;
+      v2 += 0x400000;
+      continue;
+    }
+
+    /* Clear up to the end of this page table in one go. */
+    unsigned n = 1024 - ((v2 >> 12) & 0x3FF);
+    if (n > (end - v2) >> 12)
+      n = (end - v2) >> 12;
+
+    uint32_t *page_table_entry = (uint32_t*) (MMAP_PAGE_TABLES + PAGE_TABLE_IDX(v2)*4);
+    for (unsigned i = 0; i < n; ++i) {
+      if ((page_table_entry[i] & X86_PRESENT) == 0)
+        panic("Tried to unmap a page that isn't mapped!");
+      page_table_entry[i] = 0;
+    }
+    v2 += n*0x1000;
+  }
+
+  /* Invalidate the TLB once, for the whole range. */
+  flush_tlb(v, num_pages);
+
+  spinlock_release(&current->lock);
+  return 0;
+}
+
 uintptr_t iterate_mappings(uintptr_t v) {
   while (v < 0xFFFFF000) {
     v += 0x1000;
@@ -176,6 +383,12 @@ uint64_t get_mapping(uintptr_t v, unsigned *flags) {
   if ((*page_dir_entry & X86_PRESENT) == 0)
     return ~0ULL;
 
+  if (*page_dir_entry & X86_LARGE) {
+    if (flags)
+      *flags = from_x86_flags(*page_dir_entry & 0xFFF);
+    return (*page_dir_entry & 0xFFC00000) + (v & 0x3FF000);
+  }
+
   uint32_t *page_table_entry = (uint32_t*) (MMAP_PAGE_TABLES + PAGE_TABLE_IDX(v)*4);
   if ((*page_table_entry & X86_PRESENT) == 0)
     return ~0ULL;
@@ -191,37 +404,64 @@ int is_mapped(uintptr_t v) {
   return get_mapping(v, &flags) != ~0ULL;
 }
 
+int zero_page(uint64_t p) {
+  /* Never use map() here, which may itself be waiting on a zeroed page
+     table. */
+  uint8_t *v = get_phys(0, p);
+  memset(v, 0, 0x1000);
+  put_phys(0, v);
+  return 0;
+}
+
 static int page_fault(x86_regs_t *regs, void *ptr) {
   uint32_t cr2 = read_cr2();
   unsigned flags;
 
   uint32_t p = (uint32_t)get_mapping(cr2, &flags);
 
+  /* The page may be part of a lazy allocation that has not been touched
+     yet. */
+  if (!(regs->error_code & X86_PRESENT) && vmspace_fault(cr2) == 0)
+    return 0;
+
   if ((regs->error_code & (X86_PRESENT|X86_WRITE)) &&
       p != ~0UL && (flags & PAGE_COW) ) {
     /* Page was marked copy-on-write. */
-    uint32_t p2 = (uint32_t)alloc_page(PAGE_REQ_UNDER4GB);
+    uint32_t v = cr2 & 0xFFFFF000;
 
-    /* We have to copy the page. In order to avoid a costly and 
-       non-reentrant map/unmap pair to temporarily have them
-       both mapped into memory, copy first into a buffer on
-       the stack (this means the stack must be >4KB). */
-    uint8_t buffer[4096];
+    /* If every other sharer has already taken its own copy, the page is
+       ours alone and can simply be made writable again. */
+    if (page_sole_owner(p)) {
+      uint32_t *page_table_entry =
+        (uint32_t*) (MMAP_PAGE_TABLES + PAGE_TABLE_IDX(v)*4);
+      *page_table_entry = (*page_table_entry & ~X86_COW) | X86_WRITE;
 
-    uint32_t v = cr2 & 0xFFFFF000;
-    memcpy(buffer, (uint8_t*)v, 0x1000);
-    
-    if (unmap(v, 1) == -1)
-      panic("unmap() failed during copy-on-write!");
+      uintptr_t *pv = (uintptr_t*)v;
+      __asm__ volatile("invlpg %0" : : "m" (*pv));
+      return 0;
+    }
+
+    uint64_t p2 = alloc_page(PAGE_REQ_UNDER4GB);
+    if (p2 == ~0ULL)
+      panic("Out of memory during copy-on-write!");
 
-    unsigned f = ((flags & X86_USER) ? PAGE_USER : 0) |
-      ((flags & X86_EXECUTE) ? PAGE_EXECUTE : 0) |
-      PAGE_WRITE;
-    if (map(v, p2, 1, f) == -1)
-      panic("map() failed during copy-on-write!");
+    /* Copy straight into the new page, then point the mapping at it. */
+    uint8_t *dest = get_phys(0, p2);
+    memcpy(dest, (uint8_t*)v, 0x1000);
+    put_phys(0, dest);
 
-    memcpy((uint8_t*)v, buffer, 0x1000);
+    unsigned f = (flags & (PAGE_USER|PAGE_EXECUTE)) | PAGE_WRITE;
+    uint32_t *page_table_entry =
+      (uint32_t*) (MMAP_PAGE_TABLES + PAGE_TABLE_IDX(v)*4);
+    *page_table_entry = (p2 & 0xFFFFF000) | to_x86_flags(f) | X86_PRESENT;
 
+    uintptr_t *pv = (uintptr_t*)v;
+    __asm__ volatile("invlpg %0" : : "m" (*pv));
+
+    /* Drop our share of the original, freeing it if every other sharer
+       freed theirs while we copied. */
+    if (page_unref(p) == 0)
+      free_page(p);
     return 0;
   }
 
@@ -261,9 +501,24 @@ int init_virtual_memory(uintptr_t *pages) {
 
   ++n;
 
-  /* Ensure the page table is mapped for the area required by the PMM. */
+  /* Bringup only enables large pages if the CPU supports them. */
+  if (read_cr4() & CR4_PSE)
+    x86_large_page_size = 0x400000;
+
+  /* Create the direct map, if large pages are available. None of these
+     directory entries can be in use yet. Without it, physical pages are
+     reached through the scratch windows instead. */
+  if (x86_large_page_size) {
+    for (uintptr_t v = MMAP_DIRECT; v < MMAP_DIRECT_END; v += 0x400000)
+      a.directory[PAGE_DIR_IDX(v)] =
+        (v - MMAP_DIRECT) | X86_PRESENT | X86_WRITE | X86_LARGE;
+    direct_mapped = 1;
+  }
+
+  /* Ensure the page table is mapped for the area required by the PMM,
+     including the scratch windows. */
   unsigned last_table = ~0U;
-  for (uintptr_t addr = MMAP_PMM_STACK2; addr <= MMAP_PMM_STACKEND; addr += 0x1000) {
+  for (uintptr_t addr = MMAP_KERNEL_SCRATCH; addr <= MMAP_PMM_STACKEND; addr += 0x1000) {
     if (PAGE_DIR_IDX(addr) != last_table) {
       if (n >= NUM_INITIAL_PAGES)
         panic("init_virtual_memory() required more than NUM_INITIAL_PAGES!");
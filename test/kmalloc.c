@@ -6,34 +6,45 @@
 #include "kmalloc.h"
 #include "x86/io.h"
 int f () {
-  // CHECK: kmalloc(0x10): 0xfefd400{{4|8}}
-  // CHECK: kmalloc(0x10): 0xfefd402{{4|8}}
-  // CHECK: kmalloc(0x10): 0xfefd404{{4|8}}
-  // CHECK: kmalloc(0x10): 0xfefd406{{4|8}}
+  // CHECK: kmalloc(0x10): 0xfec0000{{4|8}}
+  // CHECK: kmalloc(0x10): 0xfec0002{{4|8}}
+  // CHECK: kmalloc(0x10): 0xfec0004{{4|8}}
+  // CHECK: kmalloc(0x10): 0xfec0006{{4|8}}
   kprintf("kmalloc(0x10): %p\n", kmalloc(0x10));
   kprintf("kmalloc(0x10): %p\n", kmalloc(0x10));
   kprintf("kmalloc(0x10): %p\n", kmalloc(0x10));
   kprintf("kmalloc(0x10): %p\n", kmalloc(0x10));
 
-  // CHECK: kmalloc(0x8): 0xfefd000{{4|8}}
-  // CHECK: kmalloc(0x8): 0xfefd001{{4|8}}
-  // CHECK: kmalloc(0x8): 0xfefd002{{4|8}}
+  // CHECK: kmalloc(0x8): 0xfec0200{{4|8}}
+  // CHECK: kmalloc(0x8): 0xfec0201{{4|8}}
+  // CHECK: kmalloc(0x8): 0xfec0202{{4|8}}
   kprintf("kmalloc(0x8): %p\n", kmalloc(0x8));
   kprintf("kmalloc(0x8): %p\n", kmalloc(0x8));
   kprintf("kmalloc(0x8): %p\n", kmalloc(0x8));
 
-  kfree((void*)0xfefd0010 + sizeof(uintptr_t));
-  // CHECK: kmalloc(0x8): 0xfefd001{{4|8}}
+  kfree((void*)0xfec02010 + sizeof(uintptr_t));
+  // CHECK: kmalloc(0x8): 0xfec0201{{4|8}}
   kprintf("kmalloc(0x8): %p\n", kmalloc(0x8));
 
-  // CHECK: kmalloc(0x400): 0xfefd600{{4|8}}
-  // CHECK: kmalloc(0x400): 0xfefd200{{4|8}}
+  // CHECK: kmalloc(0x400): 0xfec0500{{4|8}}
+  // CHECK: kmalloc(0x400): 0xfec0600{{4|8}}
   kprintf("kmalloc(0x400): %p\n", kmalloc(0x400));
   kprintf("kmalloc(0x400): %p\n", kmalloc(0x400));
 
-  kfree((void*)0xfefd6004);
+  kmalloc_stats_t s;
+  kmalloc_get_stats(&s);
+  // CHECK: kmalloc-16: 1 slabs, 3 in use
+  // CHECK: kmalloc-32: 1 slabs, 4 in use
+  kprintf("kmalloc-%d: %d slabs, %d in use\n", s.caches[1].size,
+          s.caches[1].slabs, s.caches[1].in_use);
+  kprintf("kmalloc-%d: %d slabs, %d in use\n", s.caches[2].size,
+          s.caches[2].slabs, s.caches[2].in_use);
+  // CHECK: large: 2 0
+  kprintf("large: %d %d\n", s.large_allocs, s.large_frees);
 
-  kprintf("ismapped: %d\n", is_mapped(0xfefd6000));
+  kfree((void*)0xfec05004);
+
+  kprintf("ismapped: %d\n", is_mapped(0xfec05000));
 
   kprintf("kmalloc(0x400): %p\n", kmalloc(0x400));
 
@@ -0,0 +1,157 @@
+// RUN: %compile %s -o %t && %run %t only-run pmm-test 2>&1 | %FileCheck %s
+
+#include "hal.h"
+#include "mmap.h"
+#include "stdio.h"
+#include "string.h"
+#include "vmspace.h"
+
+// A cache of pages that is handed back under memory pressure.
+static uint64_t hoard[16];
+static unsigned num_hoarded = 0;
+static unsigned shrink_hoard(unsigned nr_pages, int req) {
+  unsigned n = 0;
+  while (num_hoarded > 0 && n < nr_pages) {
+    free_page(hoard[--num_hoarded]);
+    ++n;
+  }
+  return n;
+}
+
+static uint64_t all[4096];
+
+int f () {
+  uint64_t pages[4];
+
+  // CHECK: alloc_pages: 0
+  kprintf("alloc_pages: %d\n", alloc_pages(4, PAGE_REQ_NONE, pages));
+  // CHECK: distinct: 1
+  kprintf("distinct: %d\n", pages[0] != pages[1] && pages[1] != pages[2] &&
+          pages[2] != pages[3]);
+  // CHECK: free_pages: 0
+  kprintf("free_pages: %d\n", free_pages(4, pages));
+
+  // 16MB of hosted memory only warrants one 4MB region, which can be
+  // handed out exactly once.
+  uint64_t big = alloc_pages_contig(PAGE_CONTIG_MAX_ORDER, PAGE_REQ_UNDER4GB);
+  // CHECK: big: 1 aligned: 1
+  kprintf("big: %d aligned: %d\n", big != ~0ULL, (big & 0x3FFFFF) == 0);
+  // CHECK: big2: 0
+  kprintf("big2: %d\n",
+          alloc_pages_contig(PAGE_CONTIG_MAX_ORDER, PAGE_REQ_UNDER4GB) != ~0ULL);
+  // CHECK: free big: 0
+  kprintf("free big: %d\n", free_pages_contig(big, PAGE_CONTIG_MAX_ORDER));
+
+  // Smaller blocks are split from it and merge back on free.
+  uint64_t a = alloc_pages_contig(2, PAGE_REQ_UNDER4GB);
+  uint64_t b = alloc_pages_contig(2, PAGE_REQ_UNDER4GB);
+  // CHECK: a: 1 b: 1
+  kprintf("a: %d b: %d\n", (a & 0x3FFF) == 0, (b & 0x3FFF) == 0);
+  // CHECK: buddies: 1
+  kprintf("buddies: %d\n", (a ^ b) == 0x4000);
+  free_pages_contig(a, 2);
+  free_pages_contig(b, 2);
+  // CHECK: merged: 1
+  kprintf("merged: %d\n", alloc_pages_contig(PAGE_CONTIG_MAX_ORDER,
+                                             PAGE_REQ_UNDER4GB) == big);
+
+  // CHECK: bad free: -1
+  kprintf("bad free: %d\n", free_pages_contig(big + 0x1000, 2));
+
+  // Freshly allocated pages have a single owner.
+  uint64_t pg = alloc_page(PAGE_REQ_NONE);
+  // CHECK: refcount: 1
+  kprintf("refcount: %d\n", get_page(pg)->refcount);
+  // CHECK: ref: 2 unref: 1
+  int r = page_ref(pg);
+  kprintf("ref: %d unref: %d\n", r, page_unref(pg));
+
+  // A CoW fault on a page nobody else shares just makes it writable.
+  map(0x63000000, pg, 1, PAGE_COW);
+  *(volatile char*)0x63000000 = 1;
+  unsigned f;
+  uint64_t p2 = get_mapping(0x63000000, &f);
+  // CHECK: sole owner: 1 flags 1
+  kprintf("sole owner: %d flags %d\n", p2 == pg, f);
+  unmap(0x63000000, 1);
+
+  // A shared page is copied, and the original loses a reference.
+  page_ref(pg);
+  map(0x63000000, pg, 1, PAGE_COW);
+  *(volatile char*)0x63000000 = 1;
+  p2 = get_mapping(0x63000000, &f);
+  // CHECK: shared: 1 refcount: 1
+  kprintf("shared: %d refcount: %d\n", p2 != pg, get_page(pg)->refcount);
+  free_page(p2);
+  unmap(0x63000000, 1);
+  free_page(pg);
+
+  // Freeing a shared page only drops a reference; the frame stays
+  // allocated until its last sharer frees it.
+  pg = alloc_page(PAGE_REQ_NONE);
+  page_ref(pg);
+  free_page(pg);
+  unsigned rc1 = get_page(pg)->refcount;
+  free_page(pg);
+  unsigned rc0 = get_page(pg)->refcount;
+  // CHECK: shared free: 1 last free: 0
+  kprintf("shared free: %d last free: %d\n", rc1, rc0);
+
+  // Physical memory can be reached through the direct map.
+  pg = alloc_page(PAGE_REQ_NONE);
+  // CHECK: direct map: 1 1
+  kprintf("direct map: %d %d\n", phys_to_virt(pg) != NULL,
+          virt_to_phys(phys_to_virt(pg)) == pg);
+  free_page(pg);
+
+  // Zeroed allocations are zero-filled even when the pool is empty.
+  pg = alloc_page(PAGE_REQ_NONE);
+  memset(phys_to_virt(pg), 0xAA, 0x1000);
+  free_page(pg);
+  pg = alloc_page(PAGE_REQ_NONE|PAGE_REQ_ZEROED);
+  map(0x63000000, pg, 1, 0);
+  unsigned sum = 0;
+  for (unsigned i = 0; i < 0x1000; ++i)
+    sum += ((uint8_t*)0x63000000)[i];
+  // CHECK: zeroed: 1 sum: 0
+  kprintf("zeroed: %d sum: %d\n", pg != ~0ULL, sum);
+  unmap(0x63000000, 1);
+  free_page(pg);
+
+  // Running out of memory reclaims from shrinkers before failing.
+  static vmspace_t vms;
+  vmspace_init(&vms, 0x70000000, 0x100000);
+  vmspace_free(&vms, 0x1000, vmspace_alloc(&vms, 0x1000, 0), 0);
+
+  // CHECK: register_shrinker: 0
+  kprintf("register_shrinker: %d\n", register_shrinker(&shrink_hoard));
+  for (num_hoarded = 0; num_hoarded < 16; ++num_hoarded)
+    hoard[num_hoarded] = alloc_page(PAGE_REQ_NONE);
+
+  unsigned n = 0;
+  while (n < 4096 && (all[n] = alloc_page(PAGE_REQ_NONE)) != ~0ULL)
+    ++n;
+  // CHECK: exhausted: 1 hoarded: 0
+  kprintf("exhausted: %d hoarded: %d\n", n < 4096, num_hoarded);
+
+  // CHECK: vmspace_alloc: 0
+  kprintf("vmspace_alloc: %x\n", vmspace_alloc(&vms, 0x4000, PAGE_WRITE));
+
+  free_pages(n, all);
+  // CHECK: vmspace_alloc again: 1
+  uintptr_t v = vmspace_alloc(&vms, 0x4000, PAGE_WRITE);
+  kprintf("vmspace_alloc again: %d\n", v != 0);
+  vmspace_free(&vms, 0x4000, v, 1);
+
+  return 0;
+}
+
+static const char *p[] = {"console", "x86/serial",
+                          "x86/free_memory", "hosted/free_memory", "pmm",
+                          NULL};
+
+static init_fini_fn_t run_on_startup x = {
+  .name = "pmm-test",
+  .prerequisites = p,
+  .fn = &f
+};
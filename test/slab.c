@@ -5,6 +5,38 @@
 #include "slab.h"
 #include "vmspace.h"
 
+typedef struct obj {
+  unsigned magic;
+  unsigned data;
+} obj_t;
+
+static unsigned nctor = 0, ndtor = 0;
+
+/* Calls to alloc_dtor, and how many of its allocations succeeded. */
+static unsigned dtor_allocs = 0, dtor_pages = 0;
+static uint64_t all[4096];
+
+static void obj_ctor(void *p) {
+  ((obj_t*)p)->magic = 0xc0ffee;
+  ++nctor;
+}
+
+static void obj_dtor(void *p) {
+  if (((obj_t*)p)->magic == 0xc0ffee)
+    ++ndtor;
+}
+
+/* A destructor that allocates, so reclaim runs while a reap is under
+   way. */
+static void alloc_dtor(void *p) {
+  uint64_t pg = alloc_page(PAGE_REQ_NONE);
+  ++dtor_allocs;
+  if (pg != ~0ULL) {
+    ++dtor_pages;
+    free_page(pg);
+  }
+}
+
 int f () {
 
   vmspace_t vms;
@@ -13,7 +45,7 @@ int f () {
 
   slab_cache_t c;
   // CHECK: create: 0
-  kprintf("create: %d\n", slab_cache_create(&c, &vms, 1024, NULL));
+  kprintf("create: %d\n", slab_cache_create(&c, &vms, 1024, NULL, NULL));
 
   // alloc1: c10ec000
   // alloc2: c10ec400
@@ -34,11 +66,13 @@ int f () {
   slab_cache_free(&c, 0xc10ecc00);
   slab_cache_free(&c, 0xc10ed000);
 
-  // alloc1: c10ec000
-  // alloc2: c10ec400
+  // Freed objects are handed back most recently freed first, from the
+  // per-core magazine.
+  // alloc1: c10ed000
+  // alloc2: c10ecc00
   // alloc3: c10ec800
-  // alloc4: c10ecc00
-  // alloc5: c10ed000
+  // alloc4: c10ec400
+  // alloc5: c10ec000
   // alloc6: c10ed800
   kprintf("alloc1: %x\n", slab_cache_alloc(&c));
   kprintf("alloc2: %x\n", slab_cache_alloc(&c));
@@ -47,6 +81,90 @@ int f () {
   kprintf("alloc5: %x\n", slab_cache_alloc(&c));
   kprintf("alloc6: %x\n", slab_cache_alloc(&c));
 
+  // Objects come back in constructed state, and are constructed once.
+  slab_cache_t c2;
+  // CHECK: create2: 0
+  kprintf("create2: %d\n", slab_cache_create(&c2, &vms, sizeof(obj_t),
+                                             &obj_ctor, &obj_dtor));
+  obj_t *o1 = slab_cache_alloc(&c2);
+  obj_t *o2 = slab_cache_alloc(&c2);
+  // CHECK: ctor: c0ffee c0ffee 2
+  kprintf("ctor: %x %x %d\n", o1->magic, o2->magic, nctor);
+
+  o1->data = 42;
+  slab_cache_free(&c2, o2);
+  slab_cache_free(&c2, o1);
+  o1 = slab_cache_alloc(&c2);
+  // CHECK: realloc: c0ffee 42 2
+  kprintf("realloc: %x %d %d\n", o1->magic, o1->data, nctor);
+  slab_cache_free(&c2, o1);
+
+  // The destructor runs for every constructed object when its slab goes.
+  slab_cache_destroy(&c2);
+  // CHECK: dtor: 2
+  kprintf("dtor: %d\n", ndtor);
+
+  // Freed objects sit in magazines until slab_cache_shrink flushes the
+  // depot's; the slabs that empties are returned, and only the ones the
+  // per-core magazines still pin (28 objects, 4 slabs) stay.
+  slab_cache_t c3;
+  slab_cache_create(&c3, &vms, 1024, NULL, NULL);
+  slab_cache_set_max_empty(&c3, 2);
+  void *objs[70];
+  for (unsigned i = 0; i < 70; ++i)
+    objs[i] = slab_cache_alloc(&c3);
+  for (unsigned i = 0; i < 70; ++i)
+    slab_cache_free(&c3, objs[i]);
+
+  slab_cache_stats_t st;
+  slab_cache_get_stats(&c3, &st);
+  // CHECK: before: 10 slabs, 0 empty, 70 cached
+  kprintf("before: %d slabs, %d empty, %d cached\n", st.slabs, st.empty,
+          st.cached);
+  unsigned pages = slab_cache_shrink(&c3);
+  slab_cache_get_stats(&c3, &st);
+  // CHECK: shrink: 12 pages, 4 slabs, 0 empty, 10 created, 6 destroyed
+  kprintf("shrink: %d pages, %d slabs, %d empty, %d created, %d destroyed\n",
+          pages, st.slabs, st.empty, st.created, st.destroyed);
+
+  // Reaping with memory below the low watermark can reclaim, which runs
+  // the slab shrinker, from inside the reap.
+  slab_cache_t c4;
+  slab_cache_create(&c4, &vms, 1024, NULL, &alloc_dtor);
+  for (unsigned i = 0; i < 70; ++i)
+    objs[i] = slab_cache_alloc(&c4);
+  for (unsigned i = 0; i < 70; ++i)
+    slab_cache_free(&c4, objs[i]);
+
+  // Hold c4's lock while using up memory, so the shrinker leaves its slabs
+  // for the reap.
+  unsigned n = 0;
+  spinlock_acquire(&c4.lock);
+  while (n < 4096 && (all[n] = alloc_page(PAGE_REQ_NONE)) != ~0ULL)
+    ++n;
+  spinlock_release(&c4.lock);
+  unsigned reaped = slab_cache_reap();
+  // CHECK: reap: 12 pages, 42 destructed, 1
+  kprintf("reap: %d pages, %d destructed, %d\n", reaped, dtor_allocs,
+          dtor_pages > 0);
+  free_pages(n, all);
+
+  // Odd sizes are rounded up so the freelist pointers stay aligned.
+  slab_cache_t c5;
+  slab_cache_create(&c5, &vms, sizeof(void*) + 3, NULL, NULL);
+  uintptr_t a = (uintptr_t)slab_cache_alloc(&c5);
+  uintptr_t b = (uintptr_t)slab_cache_alloc(&c5);
+  // CHECK: aligned: 1 1
+  kprintf("aligned: %d %d\n", a % sizeof(void*) == 0,
+          b - a == 2 * sizeof(void*) || a - b == 2 * sizeof(void*));
+  slab_cache_free(&c5, (void*)a);
+  slab_cache_free(&c5, (void*)b);
+
+  // Unlink the caches from the global list before their storage goes.
+  slab_cache_destroy(&c);
+  slab_cache_destroy(&c3);
+  slab_cache_destroy(&c4);
+  slab_cache_destroy(&c5);
   return 0;
 }
 
@@ -4,61 +4,179 @@
 #include "stdio.h"
 #include "vmspace.h"
 
+static uint64_t all[4096];
+
 int f () {
     vmspace_t vms;
     // CHECK: init: 0
     kprintf("init: %d\n", vmspace_init(&vms, 0xC1000000, 0x1C000000));
 
-    // CHECK: alloc1: dcfea000
+    // CHECK: alloc1: dce30000
     kprintf("alloc1: %x\n", vmspace_alloc(&vms, 0x1000, 0));
-    // CHECK: alloc2: dcfe8000
+    // CHECK: alloc2: dce31000
     kprintf("alloc2: %x\n", vmspace_alloc(&vms, 0x1000, 0)); 
-    // CHECK: alloc3: dcfe9000
+    // CHECK: alloc3: dce32000
     kprintf("alloc3: %x\n", vmspace_alloc(&vms, 0x1000, 0)); 
-    // CHECK: alloc4: dcfe0000
+    // CHECK: alloc4: dce33000
     kprintf("alloc4: %x\n", vmspace_alloc(&vms, 0x1000, 0)); 
-    // CHECK: alloc5: dcfe1000
+    // CHECK: alloc5: dce34000
     kprintf("alloc5: %x\n", vmspace_alloc(&vms, 0x1000, 0)); 
-    // CHECK: alloc6: dcfe2000
+    // CHECK: alloc6: dce35000
     kprintf("alloc6: %x\n", vmspace_alloc(&vms, 0x1000, 0)); 
-    // CHECK: alloc7: dcfc0000
+    // CHECK: alloc7: dce20000
     kprintf("alloc7: %x\n", vmspace_alloc(&vms, 0x10000, 0)); 
 
-    vmspace_free(&vms, 0x1000, 0xdcfe2000, 0);
-    // CHECK: alloc8: dcfe2000
+    vmspace_free(&vms, 0x1000, 0xdce35000, 0);
+    // CHECK: alloc8: dce35000
     kprintf("alloc8: %x\n", vmspace_alloc(&vms, 0x1000, 0)); 
+    // CHECK: too large: 0
+    kprintf("too large: %x\n", vmspace_alloc(&vms, 0x20000000, 0));
 
     // If we free everything we just allocated, and then allocate
     // them again, we can check buddies were correctly merged
     // by observing that the allocations return the same values
     // in the same order.
-    vmspace_free(&vms, 0x1000, 0xdcfea000, 0);
-    vmspace_free(&vms, 0x1000, 0xdcfe8000, 0);
-    vmspace_free(&vms, 0x1000, 0xdcfe9000, 0);
-    vmspace_free(&vms, 0x1000, 0xdcfe0000, 0);
-    vmspace_free(&vms, 0x1000, 0xdcfe1000, 0);
-    vmspace_free(&vms, 0x1000, 0xdcfe2000, 0);
-    vmspace_free(&vms, 0x10000, 0xdcfc0000, 0);
-
-    // CHECK: alloc1: dcfea000
+    vmspace_free(&vms, 0x1000, 0xdce30000, 0);
+    vmspace_free(&vms, 0x1000, 0xdce31000, 0);
+    vmspace_free(&vms, 0x1000, 0xdce32000, 0);
+    vmspace_free(&vms, 0x1000, 0xdce33000, 0);
+    vmspace_free(&vms, 0x1000, 0xdce34000, 0);
+    vmspace_free(&vms, 0x1000, 0xdce35000, 0);
+    vmspace_free(&vms, 0x10000, 0xdce20000, 0);
+
+    // CHECK: alloc1: dce30000
     kprintf("alloc1: %x\n", vmspace_alloc(&vms, 0x1000, 0));
-    // CHECK: alloc2: dcfe8000
+    // CHECK: alloc2: dce31000
     kprintf("alloc2: %x\n", vmspace_alloc(&vms, 0x1000, 0)); 
-    // CHECK: alloc3: dcfe9000
+    // CHECK: alloc3: dce32000
     kprintf("alloc3: %x\n", vmspace_alloc(&vms, 0x1000, 0)); 
-    // CHECK: alloc4: dcfe0000
+    // CHECK: alloc4: dce33000
     kprintf("alloc4: %x\n", vmspace_alloc(&vms, 0x1000, 0)); 
-    // CHECK: alloc5: dcfe1000
+    // CHECK: alloc5: dce34000
     kprintf("alloc5: %x\n", vmspace_alloc(&vms, 0x1000, 0)); 
-    // CHECK: alloc6: dcfe2000
+    // CHECK: alloc6: dce35000
     kprintf("alloc6: %x\n", vmspace_alloc(&vms, 0x1000, 0)); 
-    // CHECK: alloc7: dcfc0000
+    // CHECK: alloc7: dce20000
     kprintf("alloc7: %x\n", vmspace_alloc(&vms, 0x10000, 0)); 
 
     // CHECK-NOT: Page fault
     uintptr_t *addr = (uintptr_t*)vmspace_alloc(&vms, 0x1000, 1);
     *addr = 0x42;
 
+    // Any page aligned range can be managed, and blocks are still naturally
+    // aligned.
+    vmspace_t uvms;
+    // CHECK: unaligned init: 0 -1
+    int r = vmspace_init(&uvms, 0x9000F000, 0x00100000);
+    kprintf("unaligned init: %d %d\n", r,
+            vmspace_init(&vms, 0x9000F800, 0x00100000));
+    // CHECK: aligned: 1 1 in range: 1
+    uintptr_t u1 = vmspace_alloc(&uvms, 0x4000, 0);
+    uintptr_t u2 = vmspace_alloc(&uvms, 0x10000, 0);
+    kprintf("aligned: %d %d in range: %d\n", (u1 & 0x3FFF) == 0,
+            (u2 & 0xFFFF) == 0, u1 >= 0x9000F000 && u2 < 0x9010F000);
+
+    // An extent vmspace hands out exactly what was asked for.
+    vmspace_t evms;
+    // CHECK: init extents: 0
+    kprintf("init extents: %d\n",
+            vmspace_init_extents(&evms, 0x40000000, 0x40000000));
+    // CHECK: extent1: 40000000
+    kprintf("extent1: %x\n", vmspace_alloc(&evms, 0x5000, 0));
+    // CHECK: extent2: 40005000
+    kprintf("extent2: %x\n", vmspace_alloc(&evms, 0x2001, 0));
+    // Larger than the biggest buddy block.
+    // CHECK: extent3: 40008000
+    kprintf("extent3: %x\n", vmspace_alloc(&evms, 0x30000000, 0));
+
+    // The hole left by a free is reused.
+    vmspace_free(&evms, 0x2001, 0x40005000, 0);
+    // CHECK: extent4: 40005000
+    kprintf("extent4: %x\n", vmspace_alloc(&evms, 0x2000, 0));
+
+    // Once everything is freed, it coalesces back into a single extent.
+    vmspace_free(&evms, 0x2000, 0x40005000, 0);
+    vmspace_free(&evms, 0x5000, 0x40000000, 0);
+    vmspace_free(&evms, 0x30000000, 0x40008000, 0);
+    // CHECK: whole: 40000000
+    kprintf("whole: %x\n", vmspace_alloc(&evms, 0x3FD00000, 0));
+    // CHECK: too big: 0
+    kprintf("too big: %x\n", vmspace_alloc(&evms, 0x1000, 0));
+
+    // Quantum caches hand back the most recently freed range of a size
+    // without it going back to the free lists.
+    vmspace_free(&evms, 0x3FD00000, 0x40000000, 0);
+    vmspace_stats_t st;
+    vmspace_get_stats(&evms, &st);
+    unsigned frees = st.frees[1];
+    vmspace_enable_qcache(&evms, VMSPACE_QCACHE_MAX);
+    uintptr_t q1 = vmspace_alloc(&evms, 0x2000, 0);
+    uintptr_t q2 = vmspace_alloc(&evms, 0x2000, 0);
+    vmspace_free(&evms, 0x2000, q1, 0);
+    // CHECK: qcache: 1 1
+    uintptr_t q3 = vmspace_alloc(&evms, 0x2000, 0);
+    kprintf("qcache: %d %d\n", q3 == q1, q2 == q1 + 0x2000);
+
+    vmspace_get_stats(&evms, &st);
+    // CHECK: hits: 1 misses: 2 frees: 0
+    kprintf("hits: %d misses: %d frees: %d\n", st.qcache_hits[1],
+            st.qcache_misses[1], st.frees[1] - frees);
+
+    // Cached ranges are given back when nothing else is left.
+    vmspace_free(&evms, 0x2000, q2, 0);
+    vmspace_free(&evms, 0x2000, q3, 0);
+    // CHECK: drained: 40000000
+    kprintf("drained: %x\n", vmspace_alloc(&evms, 0x3FD00000, 0));
+
+    // A lazy allocation is only backed where it is touched.
+    static vmspace_t lvms;
+    vmspace_init(&lvms, 0x80000000, 0x1000000);
+    uint8_t *lazy = (uint8_t*)vmspace_alloc(&lvms, 0x4000,
+                                            PAGE_WRITE|VMSPACE_LAZY);
+    // CHECK: lazy: 1 mapped: 0
+    kprintf("lazy: %d mapped: %d\n", lazy != NULL, is_mapped((uintptr_t)lazy));
+    lazy[0x2010] = 0x42;
+    // CHECK: touched: 0 1 0 read: 42 zero: 0
+    kprintf("touched: %d %d %d read: %x zero: %d\n",
+            is_mapped((uintptr_t)lazy), is_mapped((uintptr_t)lazy + 0x2000),
+            is_mapped((uintptr_t)lazy + 0x3000), lazy[0x2010], lazy[0x2011]);
+    vmspace_free(&lvms, 0x4000, (uintptr_t)lazy, 1);
+    // CHECK: freed: 0
+    kprintf("freed: %d\n", is_mapped((uintptr_t)lazy + 0x2000));
+
+    // Freeing a lazy allocation leaves its neighbours lazy.
+    uint8_t *l1 = (uint8_t*)vmspace_alloc(&lvms, 0x4000,
+                                          PAGE_WRITE|VMSPACE_LAZY);
+    uint8_t *l2 = (uint8_t*)vmspace_alloc(&lvms, 0x4000,
+                                          PAGE_WRITE|VMSPACE_LAZY);
+    uint8_t *l3 = (uint8_t*)vmspace_alloc(&lvms, 0x4000,
+                                          PAGE_WRITE|VMSPACE_LAZY);
+    vmspace_free(&lvms, 0x4000, (uintptr_t)l2, 1);
+    l3[0x10] = 0x24;
+    // CHECK: neighbours: 80fc4000 80fc8000 24
+    kprintf("neighbours: %x %x %x\n", l2, l3, l3[0x10]);
+    vmspace_free(&lvms, 0x4000, (uintptr_t)l1, 1);
+    vmspace_free(&lvms, 0x4000, (uintptr_t)l3, 1);
+
+    // With no memory for the lazy bitmap, a lazy allocation fails cleanly.
+    static vmspace_t lvms2;
+    vmspace_init(&lvms2, 0xA0000000, 0x1000000);
+    // Map the free list links the failed attempt will need first, by
+    // making and freeing the same allocations.
+    uintptr_t warm1 = vmspace_alloc(&lvms2, 0x4000, 0);
+    uintptr_t warm2 = vmspace_alloc(&lvms2, 0x1000, 0);
+    vmspace_free(&lvms2, 0x1000, warm2, 0);
+    vmspace_free(&lvms2, 0x4000, warm1, 0);
+    unsigned n = 0;
+    while (n < 4096 && (all[n] = alloc_page(PAGE_REQ_NONE)) != ~0ULL)
+      ++n;
+    uintptr_t nomem = vmspace_alloc(&lvms2, 0x4000, PAGE_WRITE|VMSPACE_LAZY);
+    free_pages(n, all);
+    uintptr_t mem = vmspace_alloc(&lvms2, 0x4000, PAGE_WRITE|VMSPACE_LAZY);
+    // CHECK: lazy nomem: 0 retry: 1
+    kprintf("lazy nomem: %x retry: %d\n", nomem, mem != 0);
+    vmspace_free(&lvms2, 0x4000, mem, 1);
+
     return 0;
 }
 
@@ -70,7 +70,93 @@ static int test() {
   
   // CHECK: first_set() = -1
   kprintf("first_set() = %d\n", xbitmap_first_set(&xb));
-  
+
+  // Blocks are allocated sparsely, so far-off bits are cheap to reach.
+  xbitmap_set(&xb, 20000000);
+  // CHECK: isset(20000000) = 1 isset(19999999) = 0
+  kprintf("isset(20000000) = %d isset(19999999) = %d\n",
+          xbitmap_isset(&xb, 20000000), xbitmap_isset(&xb, 19999999));
+  // CHECK: first_set() = 20000000
+  kprintf("first_set() = %d\n", xbitmap_first_set(&xb));
+  xbitmap_clear(&xb, 20000000);
+
+  // Range and bulk operations.
+  xbitmap_set_range(&xb, 30, 40);
+  // CHECK: range: 0 1 1 0
+  kprintf("range: %d %d %d %d\n", xbitmap_isset(&xb, 29),
+          xbitmap_isset(&xb, 30), xbitmap_isset(&xb, 69),
+          xbitmap_isset(&xb, 70));
+  // CHECK: popcount() = 40
+  kprintf("popcount() = %d\n", xbitmap_popcount(&xb));
+  // CHECK: find_next_set(50) = 50 find_next_set(70) = -1
+  kprintf("find_next_set(50) = %d find_next_set(70) = %d\n",
+          xbitmap_find_next_set(&xb, 50), xbitmap_find_next_set(&xb, 70));
+  xbitmap_set_range(&xb, 0, 10);
+  // CHECK: find_first_clear() = 10
+  kprintf("find_first_clear() = %d\n", xbitmap_find_first_clear(&xb));
+  // CHECK: find_run(20) = 10 find_run(21) = 70
+  kprintf("find_run(20) = %d find_run(21) = %d\n",
+          xbitmap_find_run(&xb, 20), xbitmap_find_run(&xb, 21));
+  xbitmap_clear_range(&xb, 0, 65);
+  // CHECK: first_set() = 65 popcount() = 5
+  kprintf("first_set() = %d popcount() = %d\n", xbitmap_first_set(&xb),
+          xbitmap_popcount(&xb));
+  xbitmap_clear_range(&xb, 65, 5);
+
+  // Atomic operations.
+  xbitmap_t axb;
+  xbitmap_init(&axb, get_page_size(), &alloc, &free, (void*)&loc);
+  // CHECK: claim: 0 1 2
+  int c0 = xbitmap_atomic_claim_first_clear(&axb, 100);
+  int c1 = xbitmap_atomic_claim_first_clear(&axb, 100);
+  int c2 = xbitmap_atomic_claim_first_clear(&axb, 100);
+  kprintf("claim: %d %d %d\n", c0, c1, c2);
+  xbitmap_atomic_clear(&axb, 1);
+  // CHECK: test_and_set: 0 1
+  int tas = xbitmap_atomic_test_and_set(&axb, 1);
+  kprintf("test_and_set: %d %d\n", tas, xbitmap_atomic_test_and_set(&axb, 1));
+  // CHECK: claim with limit: -1
+  kprintf("claim with limit: %d\n", xbitmap_atomic_claim_first_clear(&axb, 3));
+  xbitmap_atomic_set(&axb, 40000);
+  // CHECK: atomic isset: 1 first_set: 0
+  kprintf("atomic isset: %d first_set: %d\n",
+          xbitmap_atomic_isset(&axb, 40000), xbitmap_first_set(&axb));
+
+  // A summarised bitmap spanning many blocks.
+  xbitmap_t sxb;
+  xbitmap_init(&sxb, get_page_size(), &alloc, &free, (void*)&loc);
+  sxb.summary = 1;
+
+  xbitmap_set(&sxb, 3000000);
+  xbitmap_set(&sxb, 3000033);
+  // CHECK: summary first_set() = 3000000
+  kprintf("summary first_set() = %d\n", xbitmap_first_set(&sxb));
+  xbitmap_clear(&sxb, 3000000);
+  // CHECK: summary first_set() = 3000033
+  kprintf("summary first_set() = %d\n", xbitmap_first_set(&sxb));
+  xbitmap_set(&sxb, 40000);
+  // CHECK: summary first_set() = 40000
+  kprintf("summary first_set() = %d\n", xbitmap_first_set(&sxb));
+  // CHECK: isset(3000033) = 1 isset(3000000) = 0
+  kprintf("isset(3000033) = %d isset(3000000) = %d\n",
+          xbitmap_isset(&sxb, 3000033), xbitmap_isset(&sxb, 3000000));
+  xbitmap_clear(&sxb, 40000);
+  xbitmap_clear(&sxb, 3000033);
+  xbitmap_set_range(&sxb, 100000, 3000);
+  // CHECK: summary popcount() = 3000 find_next_set(50000) = 100000
+  kprintf("summary popcount() = %d find_next_set(50000) = %d\n",
+          xbitmap_popcount(&sxb), xbitmap_find_next_set(&sxb, 50000));
+  xbitmap_clear_range(&sxb, 100000, 3000);
+  // The next set bit is found through the level 2 summary word.
+  xbitmap_set(&sxb, 5);
+  xbitmap_set(&sxb, 30723);
+  // CHECK: summary find_next_set(6) = 30723
+  kprintf("summary find_next_set(6) = %d\n", xbitmap_find_next_set(&sxb, 6));
+  xbitmap_clear(&sxb, 5);
+  xbitmap_clear(&sxb, 30723);
+  // CHECK: summary first_set() = -1
+  kprintf("summary first_set() = %d\n", xbitmap_first_set(&sxb));
+
   return 0;
 }
 